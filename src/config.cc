@@ -0,0 +1,296 @@
+#include "config.h"
+
+#include <mutex>
+#include <filesystem>
+#include <chrono>
+#include <algorithm>
+
+#include <poll.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
+#include <spdlog/spdlog.h>
+
+#include "utf8util.h"
+#include "reg.h"
+#include "preflight.h"
+
+using namespace std;
+using namespace std::filesystem;
+using namespace spdlog;
+
+static mutex config_mutex;
+static shared_ptr<const config> config_snapshot;
+
+static uint32_t keyboard_id(uint16_t vendor_id, uint16_t product_id)
+{
+    return uint32_t(vendor_id) << 16 | product_id;
+}
+
+const keyboard_profile *config::find_keyboard(uint16_t vendor_id, uint16_t product_id) const
+{
+    auto i = keyboards.find(keyboard_id(vendor_id, product_id));
+    return i == keyboards.end() ? nullptr : &i->second;
+}
+
+static void index_keyboards(config &cfg)
+{
+    const toml::array *entries = cfg.tbl["keyboards"].as_array();
+    if (entries == nullptr) {
+        warn("No [[keyboards]] in {}", cfg.path);
+        return;
+    }
+
+    for (auto &&entry : *entries) {
+        const toml::table *keyboard = entry.as_table();
+        if (keyboard == nullptr) {
+            continue;
+        }
+
+        auto vendor_id = (*keyboard)["vendor"].value<int64_t>();
+        auto product_id = (*keyboard)["product"].value<int64_t>();
+        if (!vendor_id || !product_id) {
+            warn("Ignoring keyboard without vendor and product in {}", cfg.path);
+            continue;
+        }
+
+        uint32_t id = keyboard_id(*vendor_id, *product_id);
+        auto serial = (*keyboard)["serial"].value<string>();
+
+        auto i = cfg.keyboards.find(id);
+        if (i == cfg.keyboards.end()) {
+            keyboard_profile profile;
+            profile.vendor_id = *vendor_id;
+            profile.product_id = *product_id;
+            if (serial) {
+                profile.serials.push_back(u8dec(*serial));
+            }
+            cfg.keyboards.emplace(id, profile);
+        } else if (!i->second.serials.empty()) {
+            // An entry without a serial number matches them all
+            if (serial) {
+                i->second.serials.push_back(u8dec(*serial));
+            } else {
+                i->second.serials.clear();
+            }
+        }
+    }
+}
+
+const vector<unsigned char> &config::reports(int protocol, unsigned capabilities, size_t message_size) const
+{
+    if (protocol < KB_PROTOCOL_V2) {
+        return reports_v1;
+    }
+    if (message_size == KB_LARGE_MESSAGE_SIZE) {
+        return (capabilities & KB_CAP_BATCH) ? reports_batch_large : reports_v2_large;
+    }
+    return (capabilities & KB_CAP_BATCH) ? reports_batch : reports_v2;
+}
+
+// Frames [keys] once so that configuring a keyboard is just writing reports
+static void encode_keys(config &cfg)
+{
+    const toml::table *keys = cfg.tbl["keys"].as_table();
+    if (keys == nullptr) {
+        warn("No [keys] in {}", cfg.path);
+        return;
+    }
+
+    for (auto &&pair : *keys) {
+        string key = string(pair.first.str());
+        auto data = pair.second.value<string>();
+        if (!data) {
+            warn("Ignoring {} in {}, it isn't a string", key, cfg.path);
+            continue;
+        }
+
+        preflight_result r = preflight(data->data(), data->size());
+        if (r.invalid < data->size()) {
+            warn("Ignoring {} in {}, the keyboard can't type byte 0x{:02x} at offset {}",
+                 key, cfg.path, (unsigned char)(*data)[r.invalid], r.invalid);
+            continue;
+        }
+
+        encode_key(cfg.reports_v1, key);
+        encode_data(cfg.reports_v1, *data, KB_PROTOCOL_V1);
+
+        encode_key(cfg.reports_v2, key);
+        encode_data(cfg.reports_v2, *data, KB_PROTOCOL_V2);
+
+        encode_key(cfg.reports_v2_large, key, KB_LARGE_MESSAGE_SIZE);
+        encode_data(cfg.reports_v2_large, *data, KB_PROTOCOL_V2, KB_LARGE_MESSAGE_SIZE);
+
+        cfg.registers.emplace_back(key, *data);
+        // Preflight rejects zeros, so every keyboard reports the same hash
+        cfg.hashes.push_back(register_hash(*data, 0));
+    }
+
+    encode_batch(cfg.reports_batch, cfg.registers);
+    encode_batch(cfg.reports_batch_large, cfg.registers, KB_LARGE_MESSAGE_SIZE);
+
+    encode_key(cfg.reports_v1, ".");
+    encode_key(cfg.reports_v2, ".");
+    encode_key(cfg.reports_batch, ".");
+    encode_key(cfg.reports_v2_large, ".", KB_LARGE_MESSAGE_SIZE);
+    encode_key(cfg.reports_batch_large, ".", KB_LARGE_MESSAGE_SIZE);
+}
+
+string get_config_path()
+{
+    return string(getenv("HOME")) + "/.kb_detect.toml";
+}
+
+shared_ptr<const config> load_config(const string &path)
+{
+    auto cfg = make_shared<config>();
+    cfg->path = path;
+
+    try {
+        cfg->tbl = toml::parse_file(path);
+    } catch (const toml::parse_error &err) {
+        error("Unable to parse {}: {}", path, err.what());
+        return nullptr;
+    }
+
+    index_keyboards(*cfg);
+    encode_keys(*cfg);
+
+    return cfg;
+}
+
+vector<uint32_t> load_keyboard_ids(const string &path)
+{
+    vector<uint32_t> ids;
+    toml::table tbl;
+    try {
+        tbl = toml::parse_file(path);
+    } catch (const toml::parse_error &err) {
+        error("Unable to parse {}: {}", path, err.what());
+        return ids;
+    }
+
+    const toml::array *entries = tbl["keyboards"].as_array();
+    if (entries == nullptr) {
+        return ids;
+    }
+    for (auto &&entry : *entries) {
+        const toml::table *keyboard = entry.as_table();
+        if (keyboard == nullptr) {
+            continue;
+        }
+        auto vendor_id = (*keyboard)["vendor"].value<int64_t>();
+        auto product_id = (*keyboard)["product"].value<int64_t>();
+        if (!vendor_id || !product_id) {
+            continue;
+        }
+        uint32_t id = keyboard_id(*vendor_id, *product_id);
+        if (find(ids.begin(), ids.end(), id) == ids.end()) {
+            ids.push_back(id);
+        }
+    }
+    return ids;
+}
+
+shared_ptr<const config> current_config()
+{
+    lock_guard<mutex> lock(config_mutex);
+    return config_snapshot;
+}
+
+void set_current_config(shared_ptr<const config> cfg)
+{
+    lock_guard<mutex> lock(config_mutex);
+    config_snapshot = std::move(cfg);
+}
+
+config_watcher::config_watcher(const string &path) : path(path)
+{
+    thread = std::thread(&config_watcher::run, this);
+}
+
+config_watcher::~config_watcher()
+{
+    stop = true;
+    thread.join();
+}
+
+// A broken file keeps the last good snapshot in use
+void config_watcher::reload()
+{
+    shared_ptr<const config> cfg = load_config(path);
+    if (cfg) {
+        set_current_config(cfg);
+        info("Reloaded {}", path);
+    }
+}
+
+#ifdef __linux__
+
+void config_watcher::run()
+{
+    int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd < 0) {
+        error("inotify_init1() failed, {} will not be reloaded", path);
+        return;
+    }
+
+    // Editors often save by renaming a new file over the old one, so watch
+    // the directory and pick out events for our file by name.
+    string dir = std::filesystem::path(path).parent_path();
+    string name = std::filesystem::path(path).filename();
+    if (inotify_add_watch(fd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE) < 0) {
+        error("Unable to watch {}, {} will not be reloaded", dir, path);
+        close(fd);
+        return;
+    }
+
+    alignas(inotify_event) char events[4096];
+
+    while (!stop) {
+        pollfd pfd{fd, POLLIN, 0};
+        if (poll(&pfd, 1, 500) <= 0) {
+            continue;
+        }
+
+        bool changed = false;
+        ssize_t len;
+        while ((len = read(fd, events, sizeof(events))) > 0) {
+            for (char *p = events; p < events + len; ) {
+                inotify_event *event = reinterpret_cast<inotify_event *>(p);
+                if (event->len > 0 && name == event->name) {
+                    changed = true;
+                }
+                p += sizeof(inotify_event) + event->len;
+            }
+        }
+
+        if (changed) {
+            reload();
+        }
+    }
+
+    close(fd);
+}
+
+#else
+
+void config_watcher::run()
+{
+    error_code ec;
+    file_time_type last = last_write_time(path, ec);
+
+    while (!stop) {
+        this_thread::sleep_for(chrono::milliseconds(500));
+
+        file_time_type now = last_write_time(path, ec);
+        if (!ec && now != last) {
+            last = now;
+            reload();
+        }
+    }
+}
+
+#endif
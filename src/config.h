@@ -0,0 +1,84 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <cstdint>
+#include <thread>
+#include <atomic>
+
+#include <toml++/toml.hpp>
+
+// Every [[keyboards]] entry with the same vendor and product id
+struct keyboard_profile
+{
+    uint16_t vendor_id;
+    uint16_t product_id;
+    // Serial numbers from entries that set one.  Empty if any entry matches every serial number.
+    std::vector<std::wstring> serials;
+};
+
+// A parsed ~/.kb_detect.toml.  Never modified after load, so it can be shared
+// between threads; a changed file produces a new snapshot instead.
+struct config
+{
+    std::string path;
+    toml::table tbl;
+
+    // [[keyboards]] indexed by vendor_id << 16 | product_id
+    std::unordered_map<uint32_t, keyboard_profile> keyboards;
+
+    // The profile for a vid:pid, or nullptr for devices that aren't configured.
+    // Cheap enough to call for every device on the bus.
+    const keyboard_profile *find_keyboard(uint16_t vendor_id, uint16_t product_id) const;
+
+    // Every register in [keys], then the K report that selects '.', already
+    // encoded as KB_REPORT_SIZE byte reports for each protocol
+    std::vector<unsigned char> reports_v1;
+    std::vector<unsigned char> reports_v2;
+    // The same registers as batches for keyboards with KB_CAP_BATCH
+    std::vector<unsigned char> reports_batch;
+    // reports_v2 and reports_batch in KB_LARGE_MESSAGE_SIZE messages
+    std::vector<unsigned char> reports_v2_large;
+    std::vector<unsigned char> reports_batch_large;
+
+    // (key, text) of every register in [keys] and the register_hash of each
+    // text, the same for any capabilities as the texts hold no zeros
+    std::vector<std::pair<std::string, std::string>> registers;
+    std::vector<uint32_t> hashes;
+
+    // The reports suited to a keyboard, see query_protocol
+    const std::vector<unsigned char> &reports(int protocol, unsigned capabilities, size_t message_size) const;
+};
+
+// ~/.kb_detect.toml
+std::string get_config_path();
+
+// Parses path into a new snapshot.  Returns nullptr and logs the error if it can't.
+std::shared_ptr<const config> load_config(const std::string &path);
+
+// vendor_id << 16 | product_id of every [[keyboards]] entry in path, without
+// preparing the rest of the config.  Empty and logs the error if it can't.
+std::vector<uint32_t> load_keyboard_ids(const std::string &path);
+
+// The snapshot every lookup should use
+std::shared_ptr<const config> current_config();
+void set_current_config(std::shared_ptr<const config> cfg);
+
+// Reloads the current config whenever its file changes.  Uses inotify on
+// Linux and polls the modification time elsewhere.
+class config_watcher
+{
+public:
+    explicit config_watcher(const std::string &path);
+    ~config_watcher();
+
+private:
+    void run();
+    void reload();
+
+    std::string path;
+    std::atomic<bool> stop{false};
+    std::thread thread;
+};
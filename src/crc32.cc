@@ -0,0 +1,30 @@
+#include "crc32.h"
+
+#include <array>
+
+using namespace std;
+
+static array<uint32_t, 256> make_table()
+{
+    array<uint32_t, 256> table;
+    for (uint32_t i = 0; i < 256; ++i) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; ++k) {
+            c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+        }
+        table[i] = c;
+    }
+    return table;
+}
+
+uint32_t crc32(const void *data, size_t size)
+{
+    static const array<uint32_t, 256> table = make_table();
+
+    const unsigned char *p = static_cast<const unsigned char *>(data);
+    uint32_t c = 0xFFFFFFFFu;
+    for (size_t i = 0; i < size; ++i) {
+        c = table[(c ^ p[i]) & 0xff] ^ (c >> 8);
+    }
+    return c ^ 0xFFFFFFFFu;
+}
@@ -0,0 +1,7 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// CRC-32 as used by zlib and Ethernet (reflected, polynomial 0xEDB88320)
+uint32_t crc32(const void *data, size_t size);
@@ -0,0 +1,16 @@
+#pragma once
+
+// Stands in for the QMK headers when the firmware modules are built on the
+// host.  The host program defines kb_fw_log.
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void kb_fw_log(const char *format, ...);
+
+#ifdef __cplusplus
+}
+#endif
+
+#define dprintf(...) kb_fw_log(__VA_ARGS__)
@@ -0,0 +1,163 @@
+#include "kb_registers.h"
+
+#include <string.h>
+
+#ifdef QMK_KEYBOARD_H
+#include "print.h"
+#else
+#include "host.h"
+#endif
+
+// Each register in the arena starts with its keycode, its state, then the
+// size of its data, 16 bits little endian
+#define ENTRY_LIVE 1
+#define ENTRY_PENDING 2
+#define ENTRY_DEAD 3
+
+static size_t entry_size(const uint8_t *entry)
+{
+    return entry[2] | entry[3] << 8;
+}
+
+static size_t entry_length(const uint8_t *entry)
+{
+    return KB_REGISTERS_HEADER_SIZE + entry_size(entry);
+}
+
+// Turns the entry at offset into a hole, or gives it back to the free end of
+// the arena when it is the last one
+static void kill_entry(kb_registers *r, size_t offset)
+{
+    uint8_t *entry = &r->arena[offset];
+    size_t length = entry_length(entry);
+
+    if (offset + length == r->end) {
+        r->end = offset;
+    } else {
+        entry[1] = ENTRY_DEAD;
+        r->dead += length;
+    }
+}
+
+// Slides every register down over the holes before it, keeping their order
+static void compact(kb_registers *r)
+{
+    size_t to = 0;
+    size_t from = 0;
+
+    while (from < r->end) {
+        uint8_t *entry = &r->arena[from];
+        size_t length = entry_length(entry);
+
+        if (entry[1] == ENTRY_LIVE) {
+            r->table[entry[0]] = to;
+        } else if (entry[1] == ENTRY_PENDING) {
+            for (int i = 0; i < KB_REGISTERS_PENDING_MAX; i++) {
+                if (r->pending[i] == from) {
+                    r->pending[i] = to;
+                    break;
+                }
+            }
+        }
+
+        if (entry[1] != ENTRY_DEAD) {
+            memmove(&r->arena[to], entry, length);
+            to += length;
+        }
+        from += length;
+    }
+
+    dprintf("Compacted registers, reclaimed %u bytes\n", (unsigned) (r->end - to));
+    r->end = to;
+    r->dead = 0;
+}
+
+void kb_registers_init(kb_registers *r, uint8_t *arena, size_t size)
+{
+    r->arena = arena;
+    r->arena_size = size < KB_REGISTERS_ARENA_MAX ? size : KB_REGISTERS_ARENA_MAX;
+    r->end = 0;
+    r->dead = 0;
+    for (int i = 0; i < KB_REGISTERS_KEYCODES; i++) {
+        r->table[i] = KB_REGISTERS_NONE;
+    }
+    for (int i = 0; i < KB_REGISTERS_PENDING_MAX; i++) {
+        r->pending[i] = KB_REGISTERS_NONE;
+    }
+}
+
+const uint8_t *kb_registers_get(const kb_registers *r, uint8_t keycode, size_t *size)
+{
+    uint16_t offset = r->table[keycode];
+    if (offset == KB_REGISTERS_NONE) {
+        return NULL;
+    }
+
+    const uint8_t *entry = &r->arena[offset];
+    if (size != NULL) {
+        *size = entry_size(entry);
+    }
+    return entry + KB_REGISTERS_HEADER_SIZE;
+}
+
+int kb_registers_reserve(kb_registers *r, uint8_t keycode, size_t size)
+{
+    int handle = 0;
+    while (handle < KB_REGISTERS_PENDING_MAX && r->pending[handle] != KB_REGISTERS_NONE) {
+        handle++;
+    }
+    // The size goes in 16 bits of the header, and the header needs room too
+    size_t length = KB_REGISTERS_HEADER_SIZE + size;
+    if (handle == KB_REGISTERS_PENDING_MAX || size > 0xffff || length > r->arena_size - (r->end - r->dead)) {
+        return -1;
+    }
+
+    if (length > r->arena_size - r->end) {
+        compact(r);
+    }
+
+    uint8_t *entry = &r->arena[r->end];
+    entry[0] = keycode;
+    entry[1] = ENTRY_PENDING;
+    entry[2] = size & 0xff;
+    entry[3] = size >> 8;
+
+    r->pending[handle] = r->end;
+    r->end += length;
+    return handle;
+}
+
+uint8_t *kb_registers_data(kb_registers *r, int handle)
+{
+    return &r->arena[r->pending[handle]] + KB_REGISTERS_HEADER_SIZE;
+}
+
+void kb_registers_commit(kb_registers *r, int handle)
+{
+    uint16_t offset = r->pending[handle];
+    uint8_t *entry = &r->arena[offset];
+
+    if (r->table[entry[0]] != KB_REGISTERS_NONE) {
+        kill_entry(r, r->table[entry[0]]);
+    }
+    entry[1] = ENTRY_LIVE;
+    r->table[entry[0]] = offset;
+    r->pending[handle] = KB_REGISTERS_NONE;
+}
+
+void kb_registers_drop(kb_registers *r, int handle)
+{
+    kill_entry(r, r->pending[handle]);
+    r->pending[handle] = KB_REGISTERS_NONE;
+}
+
+size_t kb_registers_free(const kb_registers *r)
+{
+    size_t used = r->end - r->dead + KB_REGISTERS_HEADER_SIZE;
+    if (used >= r->arena_size) {
+        return 0;
+    }
+    // The size goes in 16 bits of the header
+    size_t free = r->arena_size - used;
+    return free < 0xffff ? free : 0xffff;
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Register storage for the keyboard firmware, in portable C so the same file
+// builds in a QMK keymap and on the host, where kb_sim runs it.
+//
+// Registers sit back to back in one arena the keymap hands over, each a small
+// header followed by its data.  A table indexed by keycode points at every
+// register, so a keypress finds its text in the same time however many
+// registers there are.  A replaced register leaves a hole; when the arena
+// runs out at its end, the registers after the holes slide down over them.
+// Unlike a malloc per register, free memory is never split into pieces too
+// small to use.
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Keycodes come from ascii_to_keycode_lut, so they fit in a byte
+#define KB_REGISTERS_KEYCODES 256
+// Offsets into the arena are 16 bits
+#define KB_REGISTERS_ARENA_MAX 65536
+// Registers received but not stored yet: a whole batch, or one upload
+#define KB_REGISTERS_PENDING_MAX 32
+// Bytes the arena spends on each register besides its data
+#define KB_REGISTERS_HEADER_SIZE 4
+// Table and pending entries that don't point at a register
+#define KB_REGISTERS_NONE 0xffff
+
+typedef struct
+{
+    uint8_t *arena;
+    size_t arena_size;
+    // End of the last register; the arena is free after it
+    size_t end;
+    // Bytes of the holes before end
+    size_t dead;
+    // Offset of each keycode's register
+    uint16_t table[KB_REGISTERS_KEYCODES];
+    // Offset of each reserved register, by handle
+    uint16_t pending[KB_REGISTERS_PENDING_MAX];
+} kb_registers;
+
+// Stores registers in the size bytes at arena, at most KB_REGISTERS_ARENA_MAX
+void kb_registers_init(kb_registers *r, uint8_t *arena, size_t size);
+
+// Data of the register for keycode and its size, or NULL when it has none
+const uint8_t *kb_registers_get(const kb_registers *r, uint8_t keycode, size_t *size);
+
+// Reserves size bytes for a new register for keycode and returns its handle,
+// or -1 when there is no room.  The register for keycode keeps its data until
+// the new one is committed.
+int kb_registers_reserve(kb_registers *r, uint8_t keycode, size_t size);
+
+// Where to write the data of a reserved register.  Valid until the next
+// reserve, which may move it.
+uint8_t *kb_registers_data(kb_registers *r, int handle);
+
+// Makes a reserved register the one for its keycode, freeing the one it replaces
+void kb_registers_commit(kb_registers *r, int handle);
+
+// Frees a reserved register without storing it
+void kb_registers_drop(kb_registers *r, int handle);
+
+// Largest size the next reserve can get
+size_t kb_registers_free(const kb_registers *r);
+
+#ifdef __cplusplus
+}
+#endif
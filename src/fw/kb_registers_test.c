@@ -0,0 +1,211 @@
+// Host test of kb_registers.c: make fw_test
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "kb_registers.h"
+
+static int failures;
+
+#define CHECK(cond)                                                       \
+    do {                                                                  \
+        if (!(cond)) {                                                    \
+            printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            failures++;                                                   \
+        }                                                                 \
+    } while (0)
+
+void kb_fw_log(const char *format, ...)
+{
+    (void) format;
+}
+
+// Stores size bytes of fill for keycode, returning the handle of the reservation
+static int store(kb_registers *r, uint8_t keycode, size_t size, uint8_t fill)
+{
+    int handle = kb_registers_reserve(r, keycode, size);
+    if (handle >= 0) {
+        memset(kb_registers_data(r, handle), fill, size);
+        kb_registers_commit(r, handle);
+    }
+    return handle;
+}
+
+// True when keycode holds exactly size bytes of fill
+static int holds(const kb_registers *r, uint8_t keycode, size_t size, uint8_t fill)
+{
+    size_t stored;
+    const uint8_t *data = kb_registers_get(r, keycode, &stored);
+    if (data == NULL || stored != size) {
+        return 0;
+    }
+    for (size_t i = 0; i < size; i++) {
+        if (data[i] != fill) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static void test_lookup(void)
+{
+    static uint8_t arena[1024];
+    kb_registers r;
+    kb_registers_init(&r, arena, sizeof(arena));
+
+    for (int keycode = 0; keycode < KB_REGISTERS_KEYCODES; keycode++) {
+        CHECK(kb_registers_get(&r, keycode, NULL) == NULL);
+    }
+
+    CHECK(store(&r, 'a', 10, 'a') >= 0);
+    CHECK(store(&r, 0xff, 20, 'z') >= 0);
+    CHECK(holds(&r, 'a', 10, 'a'));
+    CHECK(holds(&r, 0xff, 20, 'z'));
+    CHECK(kb_registers_get(&r, 'b', NULL) == NULL);
+    CHECK(kb_registers_get(&r, 0, NULL) == NULL);
+}
+
+// A replaced register keeps its data until the new one is committed
+static void test_replace(void)
+{
+    static uint8_t arena[1024];
+    kb_registers r;
+    kb_registers_init(&r, arena, sizeof(arena));
+
+    CHECK(store(&r, 'a', 100, 1) >= 0);
+    size_t before = kb_registers_free(&r);
+
+    int handle = kb_registers_reserve(&r, 'a', 200);
+    CHECK(handle >= 0);
+    memset(kb_registers_data(&r, handle), 2, 200);
+    CHECK(holds(&r, 'a', 100, 1));
+
+    kb_registers_commit(&r, handle);
+    CHECK(holds(&r, 'a', 200, 2));
+    // The old data is a hole now, so only the growth is used up
+    CHECK(kb_registers_free(&r) == before - 100);
+    CHECK(r.dead == KB_REGISTERS_HEADER_SIZE + 100);
+}
+
+// Dropping the last reservation hands its bytes straight back
+static void test_drop_tail(void)
+{
+    static uint8_t arena[1024];
+    kb_registers r;
+    kb_registers_init(&r, arena, sizeof(arena));
+
+    CHECK(store(&r, 'a', 50, 1) >= 0);
+    size_t end = r.end;
+    size_t free_before = kb_registers_free(&r);
+
+    int handle = kb_registers_reserve(&r, 'b', 300);
+    CHECK(handle >= 0);
+    kb_registers_drop(&r, handle);
+    CHECK(r.end == end);
+    CHECK(r.dead == 0);
+    CHECK(kb_registers_free(&r) == free_before);
+    CHECK(kb_registers_get(&r, 'b', NULL) == NULL);
+
+    // One before the end leaves a hole instead
+    int first = kb_registers_reserve(&r, 'b', 30);
+    int second = kb_registers_reserve(&r, 'c', 40);
+    CHECK(first >= 0 && second >= 0);
+    kb_registers_drop(&r, first);
+    CHECK(r.dead == KB_REGISTERS_HEADER_SIZE + 30);
+    kb_registers_commit(&r, second);
+    CHECK(kb_registers_get(&r, 'b', NULL) == NULL);
+    CHECK(kb_registers_get(&r, 'c', NULL) != NULL);
+}
+
+// Filling the holes moves committed and pending registers, which must still
+// be found by keycode and handle afterwards
+static void test_compact(void)
+{
+    static uint8_t arena[512];
+    kb_registers r;
+    kb_registers_init(&r, arena, sizeof(arena));
+
+    CHECK(store(&r, 'a', 100, 'a') >= 0);
+    CHECK(store(&r, 'b', 100, 'b') >= 0);
+    CHECK(store(&r, 'c', 100, 'c') >= 0);
+    // The first a becomes a hole in front of the others
+    CHECK(store(&r, 'a', 50, 'A') >= 0);
+    int pending = kb_registers_reserve(&r, 'd', 40);
+    CHECK(pending >= 0);
+    memset(kb_registers_data(&r, pending), 'd', 40);
+
+    size_t live = r.end - r.dead;
+    CHECK(r.dead > 0);
+
+    // Doesn't fit after end, but does once the holes are gone
+    size_t size = r.arena_size - r.end + 20;
+    CHECK(size <= kb_registers_free(&r));
+    int big = kb_registers_reserve(&r, 'f', size);
+    CHECK(big >= 0);
+    CHECK(r.dead == 0);
+    CHECK(r.end == live + KB_REGISTERS_HEADER_SIZE + size);
+    memset(kb_registers_data(&r, big), 'f', size);
+
+    CHECK(holds(&r, 'a', 50, 'A'));
+    CHECK(holds(&r, 'c', 100, 'c'));
+    CHECK(holds(&r, 'b', 100, 'b'));
+
+    uint8_t *data = kb_registers_data(&r, pending);
+    CHECK(data[0] == 'd' && data[39] == 'd');
+    kb_registers_commit(&r, pending);
+    kb_registers_commit(&r, big);
+    CHECK(holds(&r, 'd', 40, 'd'));
+    CHECK(holds(&r, 'f', size, 'f'));
+    CHECK(kb_registers_free(&r) == 0 || kb_registers_reserve(&r, 'g', kb_registers_free(&r) + 1) < 0);
+}
+
+// Arenas are cut to KB_REGISTERS_ARENA_MAX and registers to 16 bit sizes
+static void test_limits(void)
+{
+    size_t size = KB_REGISTERS_ARENA_MAX + 1024;
+    uint8_t *arena = malloc(size);
+    kb_registers r;
+    kb_registers_init(&r, arena, size);
+
+    CHECK(r.arena_size == KB_REGISTERS_ARENA_MAX);
+    CHECK(kb_registers_free(&r) == KB_REGISTERS_ARENA_MAX - KB_REGISTERS_HEADER_SIZE);
+    CHECK(kb_registers_reserve(&r, 'a', 0x10000) < 0);
+
+    int handle = kb_registers_reserve(&r, 'a', KB_REGISTERS_ARENA_MAX - KB_REGISTERS_HEADER_SIZE);
+    CHECK(handle >= 0);
+    CHECK(kb_registers_free(&r) == 0);
+    CHECK(kb_registers_reserve(&r, 'b', 0) < 0);
+    kb_registers_commit(&r, handle);
+    CHECK(kb_registers_get(&r, 'a', NULL) != NULL);
+
+    // Every pending handle in use
+    kb_registers_init(&r, arena, 1024);
+    int handles[KB_REGISTERS_PENDING_MAX];
+    for (int i = 0; i < KB_REGISTERS_PENDING_MAX; i++) {
+        handles[i] = kb_registers_reserve(&r, i, 1);
+        CHECK(handles[i] >= 0);
+    }
+    CHECK(kb_registers_reserve(&r, 'x', 1) < 0);
+    kb_registers_drop(&r, handles[3]);
+    CHECK(kb_registers_reserve(&r, 'x', 1) == handles[3]);
+
+    free(arena);
+}
+
+int main(void)
+{
+    test_lookup();
+    test_replace();
+    test_drop_tail();
+    test_compact();
+    test_limits();
+
+    if (failures > 0) {
+        printf("%d checks failed\n", failures);
+        return 1;
+    }
+    printf("All checks passed\n");
+    return 0;
+}
@@ -3,15 +3,15 @@
 using namespace std;
 
 #define MAX_STR 255
-wchar_t wstr[MAX_STR];
 
 wstring get_vendor(hid_device *dev) {
     // Read the Manufacturer String
+    wchar_t wstr[MAX_STR];
     wstr[0] = 0x0000;
     int res = hid_get_manufacturer_string(dev, wstr, MAX_STR);
     if (res < 0) {
         printf("Unable to read manufacturer string\n");
-        exit(1);
+        return wstring();
     }
 
     return wstring(wstr);
@@ -19,11 +19,12 @@ wstring get_vendor(hid_device *dev) {
 
 wstring get_product(hid_device *dev) {
     // Read the Product String
+    wchar_t wstr[MAX_STR];
     wstr[0] = 0x0000;
     int res = hid_get_product_string(dev, wstr, MAX_STR);
     if (res < 0) {
-        printf("Unable to read manufacturer string\n");
-        exit(1);
+        printf("Unable to read product string\n");
+        return wstring();
     }
 
     return wstring(wstr);
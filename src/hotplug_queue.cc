@@ -0,0 +1,91 @@
+#include "hotplug_queue.h"
+
+#include <algorithm>
+
+using namespace std;
+using namespace std::chrono;
+
+hotplug_queue::hotplug_queue(milliseconds debounce, handler on_arrival)
+    : debounce(debounce), on_arrival(on_arrival), thread(&hotplug_queue::run, this)
+{
+}
+
+hotplug_queue::~hotplug_queue()
+{
+    stop();
+}
+
+void hotplug_queue::stop()
+{
+    {
+        lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    changed.notify_all();
+    if (thread.joinable()) {
+        thread.join();
+    }
+}
+
+void hotplug_queue::arrived(uint16_t vendor_id, uint16_t product_id, const string &location)
+{
+    {
+        lock_guard<std::mutex> lock(mutex);
+        steady_clock::time_point now = steady_clock::now();
+        uint32_t id = (uint32_t) vendor_id << 16 | product_id;
+
+        // Another arrival restarts the wait but keeps the time of the first
+        auto i = devices.find(location);
+        if (i != devices.end() && i->second.first.id == id) {
+            i->second.due = now + debounce;
+        } else {
+            devices[location] = pending{arrival{id, now}, now + debounce};
+        }
+    }
+    changed.notify_all();
+}
+
+void hotplug_queue::left(const string &location)
+{
+    lock_guard<std::mutex> lock(mutex);
+    devices.erase(location);
+}
+
+void hotplug_queue::run()
+{
+    unique_lock<std::mutex> lock(mutex);
+
+    while (!stopping) {
+        if (devices.empty()) {
+            changed.wait(lock);
+            continue;
+        }
+
+        steady_clock::time_point now = steady_clock::now();
+        steady_clock::time_point next = steady_clock::time_point::max();
+        vector<arrival> ready;
+
+        for (auto i = devices.begin(); i != devices.end(); ) {
+            if (i->second.due <= now) {
+                uint32_t id = i->second.first.id;
+                auto same = [id](const arrival &a) { return a.id == id; };
+                if (find_if(ready.begin(), ready.end(), same) == ready.end()) {
+                    ready.push_back(i->second.first);
+                }
+                i = devices.erase(i);
+            } else {
+                next = min(next, i->second.due);
+                ++i;
+            }
+        }
+
+        if (!ready.empty()) {
+            lock.unlock();
+            on_arrival(ready);
+            lock.lock();
+            continue;
+        }
+
+        changed.wait_until(lock, next);
+    }
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Collects USB arrivals from the libusb hotplug callback, which must not
+// block, and hands them on from its own thread once the device has been
+// quiet for the debounce time.  Repeated arrivals of the same device (e.g.
+// one per interface of a composite device) are reported once, and a device
+// that leaves before then isn't reported at all.
+class hotplug_queue
+{
+public:
+    struct arrival
+    {
+        // vendor_id << 16 | product_id
+        uint32_t id;
+        // When the device first arrived, before the debounce
+        std::chrono::steady_clock::time_point time;
+    };
+
+    // Called with every device that arrived, each listed once
+    using handler = std::function<void(const std::vector<arrival> &arrivals)>;
+
+    hotplug_queue(std::chrono::milliseconds debounce, handler on_arrival);
+    ~hotplug_queue();
+
+    // location names the port the device is plugged into, e.g. "1-2.3" for
+    // port 3 of the hub on port 2 of bus 1
+    void arrived(uint16_t vendor_id, uint16_t product_id, const std::string &location);
+    void left(const std::string &location);
+
+    // Joins the thread, dropping arrivals still being debounced, so the
+    // handler is never called afterwards.  The destructor stops it too.
+    void stop();
+
+private:
+    void run();
+
+    struct pending
+    {
+        arrival first;
+        std::chrono::steady_clock::time_point due;
+    };
+
+    std::chrono::milliseconds debounce;
+    handler on_arrival;
+
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::map<std::string, pending> devices;
+    bool stopping{false};
+    std::thread thread;
+};
@@ -0,0 +1,348 @@
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <chrono>
+#include <sstream>
+#include <filesystem>
+
+#include <spdlog/spdlog.h>
+#include <spdlog/cfg/env.h>
+#include <hidapi.h>
+#include <cxxopts.hpp>
+
+#include "reg.h"
+#include "kb_sim.h"
+#include "utf8util.h"
+#include "lz.h"
+
+using namespace std;
+using namespace std::chrono;
+using namespace fmt;
+using namespace spdlog;
+
+struct bench_result
+{
+    size_t size;
+    int uploads;
+    // Uploads the keyboard didn't store; they don't count towards bytes_per_sec
+    int failed;
+    uint64_t reports;
+    double bytes_per_sec;
+    double reports_per_sec;
+    uint64_t p50_us;
+    uint64_t p99_us;
+    uint64_t p999_us;
+};
+
+// Payload sizes from 1 byte up to the firmware's 8 KB register limit
+vector<size_t> payload_sizes(size_t max_size)
+{
+    vector<size_t> sizes;
+    for (size_t size = 1; size < max_size; size *= 2) {
+        sizes.push_back(size);
+    }
+    sizes.push_back(max_size);
+    return sizes;
+}
+
+// Printable ASCII, since real firmware stops at the first zero
+string make_payload(size_t size)
+{
+    string payload(size, ' ');
+    for (size_t i = 0; i < size; ++i) {
+        payload[i] = 'a' + (i % 26);
+    }
+    return payload;
+}
+
+bench_result run(transport *dev, size_t size, int uploads, int protocol, int window)
+{
+    string payload = make_payload(size);
+
+    dev->rtt.clear();
+    uint64_t reports_before = dev->reports;
+
+    int failed{0};
+    steady_clock::time_point start = steady_clock::now();
+    for (int i = 0; i < uploads; ++i) {
+        if (!store_data(dev, payload, protocol, window)) {
+            failed++;
+        }
+    }
+    duration<double> elapsed = steady_clock::now() - start;
+
+    bench_result r;
+    r.size = size;
+    r.uploads = uploads;
+    r.failed = failed;
+    r.reports = dev->reports - reports_before;
+    r.bytes_per_sec = size * (uploads - failed) / elapsed.count();
+    r.reports_per_sec = r.reports / elapsed.count();
+    r.p50_us = dev->rtt.percentile(0.5);
+    r.p99_us = dev->rtt.percentile(0.99);
+    r.p999_us = dev->rtt.percentile(0.999);
+    return r;
+}
+
+// Milliseconds per upload of payload.  Adds the uploads that failed to failed.
+double time_uploads(transport *dev, const string &payload, int uploads, int protocol, int window, int &failed)
+{
+    steady_clock::time_point start = steady_clock::now();
+    for (int i = 0; i < uploads; ++i) {
+        if (!store_data(dev, payload, protocol, window)) {
+            failed++;
+        }
+    }
+    duration<double, milli> elapsed = steady_clock::now() - start;
+    return elapsed.count() / uploads;
+}
+
+// Uploads every file with and without compression to show when it pays off
+int run_corpus(transport *dev, const vector<string> &files, size_t max_size, int uploads, int protocol, int window)
+{
+    if (protocol < KB_PROTOCOL_V2 || !(dev->capabilities & KB_CAP_LZ)) {
+        error("Compression needs a protocol v2 keyboard that advertises it");
+        return 2;
+    }
+    unsigned capabilities = dev->capabilities;
+    int exit_status = 0;
+
+    cout << format("{:<24} {:>6} {:>6} {:>6} {:>8} {:>8} {:>9} {:>9} {:>6}",
+                   "file", "bytes", "packed", "ratio", "reports", "lz", "plain ms", "lz ms", "failed") << endl;
+
+    for (const string &file : files) {
+        ifstream in(file, ios::binary);
+        if (!in) {
+            error("Unable to read {}", file);
+            return 2;
+        }
+        stringstream ss;
+        ss << in.rdbuf();
+        string payload = ss.str();
+        if (payload.size() > max_size) {
+            warn("Only using the first {} bytes of {}", max_size, file);
+            payload.resize(max_size);
+        }
+
+        string packed = lz_compress(payload.data(), payload.size());
+
+        vector<unsigned char> plain_reports;
+        encode_data(plain_reports, payload, protocol, dev->message_size);
+        vector<unsigned char> lz_reports;
+        encode_compressed(lz_reports, payload, dev->message_size);
+
+        int failed{0};
+        dev->capabilities = capabilities & ~KB_CAP_LZ;
+        double plain_ms = time_uploads(dev, payload, uploads, protocol, window, failed);
+        dev->capabilities = capabilities;
+        double lz_ms = time_uploads(dev, payload, uploads, protocol, window, failed);
+        if (failed > 0) {
+            exit_status = 1;
+        }
+
+        cout << format("{:<24} {:>6} {:>6} {:>6.2f} {:>8} {:>8} {:>9.2f} {:>9.2f} {:>6}",
+                       std::filesystem::path(file).filename().string(), payload.size(), packed.size(),
+                       payload.empty() ? 1.0 : (double) packed.size() / payload.size(),
+                       plain_reports.size() / dev->report_size(), lz_reports.size() / dev->report_size(),
+                       plain_ms, lz_ms, failed) << endl;
+    }
+
+    if (exit_status != 0) {
+        error("Some uploads failed");
+    }
+    return exit_status;
+}
+
+// Baseline files hold one "size bytes_per_sec" line per payload size
+map<size_t, double> read_baseline(const string &path)
+{
+    map<size_t, double> baseline;
+    ifstream in(path);
+    size_t size;
+    double bytes_per_sec;
+    while (in >> size >> bytes_per_sec) {
+        baseline[size] = bytes_per_sec;
+    }
+    return baseline;
+}
+
+void write_baseline(const string &path, const vector<bench_result> &results)
+{
+    ofstream out(path);
+    for (const bench_result &r : results) {
+        out << r.size << " " << r.bytes_per_sec << "\n";
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    spdlog::cfg::load_env_levels();
+
+    cxxopts::Options options(argv[0], "Measures register upload throughput and latency");
+
+    bool hardware;
+    int vendor_id{0};
+    int product_id{0};
+    int protocol{0};
+    int window{KB_DEFAULT_WINDOW};
+    int uploads{5};
+    int max_size{8192};
+    int sim_latency{1000};
+    int sim_jitter{0};
+    int sim_loss{0};
+    int sim_protocol{KB_PROTOCOL_V2};
+    int sim_report_size{KB_MESSAGE_SIZE};
+    string baseline_path;
+    string save_path;
+    double max_regression{10.0};
+    vector<string> corpus;
+
+    options.add_options()
+        ("h,help", "displays help text")
+        ("hardware", "benchmarks a real keyboard instead of the simulator", cxxopts::value(hardware))
+        ("v,vendor", "specifies vendor id", cxxopts::value(vendor_id))
+        ("p,product", "specifies product id", cxxopts::value(product_id))
+        ("P,protocol", "forces protocol version (0 asks the keyboard)", cxxopts::value(protocol))
+        ("w,window", "reports in flight for protocol v2", cxxopts::value(window))
+        ("n,uploads", "uploads per payload size", cxxopts::value(uploads))
+        ("max-size", "largest payload in bytes", cxxopts::value(max_size))
+        ("sim-latency", "simulated reply latency in microseconds", cxxopts::value(sim_latency))
+        ("sim-jitter", "simulated reply jitter in microseconds", cxxopts::value(sim_jitter))
+        ("sim-loss", "percentage of simulated reports and replies that are lost", cxxopts::value(sim_loss))
+        ("sim-protocol", "highest protocol the simulated keyboard speaks", cxxopts::value(sim_protocol))
+        ("sim-report-size", "bytes per report of the simulated keyboard, 32 or 64", cxxopts::value(sim_report_size))
+        ("b,baseline", "fails if throughput dropped compared to this file", cxxopts::value(baseline_path))
+        ("s,save-baseline", "writes the results to this file", cxxopts::value(save_path))
+        ("max-regression", "allowed throughput drop in percent", cxxopts::value(max_regression))
+        ("c,corpus", "compares plain and compressed uploads of these comma separated files", cxxopts::value(corpus))
+        ;
+
+    auto result = options.parse(argc, argv);
+
+    if (result.count("help"))
+    {
+        cout << options.help() << endl;
+        return 0;
+    }
+
+    // Every rate and time is per upload
+    if (uploads < 1) {
+        error("-n must be at least 1");
+        return 1;
+    }
+
+    transport *dev;
+    if (hardware) {
+        hid_version_check();
+
+        if (hid_init()) {
+            return -100;
+        }
+
+        dev = open_raw(vendor_id, product_id);
+        if (!dev) {
+            hid_exit();
+            return -101;
+        }
+    } else {
+        kb_sim_options sim_options;
+        sim_options.latency = microseconds(sim_latency);
+        sim_options.jitter = microseconds(sim_jitter);
+        sim_options.loss = sim_loss;
+        sim_options.protocol = sim_protocol;
+        sim_options.report_size = sim_report_size == KB_LARGE_MESSAGE_SIZE ? KB_LARGE_MESSAGE_SIZE : KB_MESSAGE_SIZE;
+        dev = new kb_sim(sim_options);
+    }
+
+    if (protocol == 0) {
+        protocol = query_protocol(dev);
+    }
+
+    info("Benchmarking {} with protocol v{} and {} byte reports", u8enc(dev->product()), protocol, dev->message_size);
+
+    // The register used for benchmarking is overwritten by every upload
+    set_key(dev, "~");
+
+    if (!corpus.empty()) {
+        int exit_status = run_corpus(dev, corpus, max_size, uploads, protocol, window);
+
+        delete dev;
+        if (hardware) {
+            /* Free static HIDAPI objects. */
+            hid_exit();
+        }
+        return exit_status;
+    }
+
+    // The payloads repeat the alphabet, so with compression the sweep would
+    // measure the compressor instead of the transfer; -c compares the two
+    dev->capabilities &= ~KB_CAP_LZ;
+
+    vector<bench_result> results;
+
+    cout << format("{:>6} {:>7} {:>6} {:>8} {:>12} {:>10} {:>8} {:>8} {:>8}",
+                   "bytes", "uploads", "failed", "reports", "bytes/s", "reports/s", "p50us", "p99us", "p999us") << endl;
+
+    for (size_t size : payload_sizes(max_size)) {
+        bench_result r = run(dev, size, uploads, protocol, window);
+        results.push_back(r);
+
+        cout << format("{:>6} {:>7} {:>6} {:>8} {:>12.0f} {:>10.0f} {:>8} {:>8} {:>8}",
+                       r.size, r.uploads, r.failed, r.reports, r.bytes_per_sec, r.reports_per_sec,
+                       r.p50_us, r.p99_us, r.p999_us) << endl;
+    }
+
+    delete dev;
+
+    if (hardware) {
+        /* Free static HIDAPI objects. */
+        hid_exit();
+    }
+
+    // A failed upload can finish sooner than a stored one, so the throughput
+    // of a run with failures can't be compared or saved
+    int failed{0};
+    for (const bench_result &r : results) {
+        failed += r.failed;
+    }
+    if (failed > 0) {
+        error("{} uploads failed", failed);
+        return 1;
+    }
+
+    if (save_path != "") {
+        write_baseline(save_path, results);
+    }
+
+    int exit_status = 0;
+
+    if (baseline_path != "") {
+        map<size_t, double> baseline = read_baseline(baseline_path);
+        if (baseline.empty()) {
+            error("No results in baseline {}", baseline_path);
+            return 2;
+        }
+
+        for (const bench_result &r : results) {
+            auto i = baseline.find(r.size);
+            if (i == baseline.end()) {
+                continue;
+            }
+
+            double change = (r.bytes_per_sec - i->second) / i->second * 100;
+            if (change < -max_regression) {
+                error("{} byte uploads dropped {:.1f}% to {:.0f} bytes/s (baseline {:.0f})",
+                      r.size, -change, r.bytes_per_sec, i->second);
+                exit_status = 1;
+            }
+        }
+
+        if (exit_status == 0) {
+            info("Throughput is within {}% of {}", max_regression, baseline_path);
+        }
+    }
+
+    return exit_status;
+}
@@ -3,6 +3,11 @@
 #include <cstdlib>
 #include <cstdio>
 #include <filesystem>
+#include <csignal>
+#include <chrono>
+#include <set>
+#include <optional>
+#include <memory>
 
 #include <unistd.h>
 
@@ -13,14 +18,28 @@
 
 #include "utf8util.h"
 #include "reg.h"
+#include "config.h"
+#include "plan.h"
+#include "trace.h"
+#include "metrics.h"
+#include "workers.h"
+#include "hotplug_queue.h"
 
 using namespace std;
 using namespace std::filesystem;
+using namespace std::chrono;
 using namespace fmt;
 using namespace spdlog;
 
 volatile bool exit_flag{false};
 
+// Keyboards configured at the same time
+static const size_t worker_count{4};
+
+// Quiet time after the last arrival before a keyboard is configured.  Also
+// gives the OS time to create the raw hid device.
+static const milliseconds hotplug_debounce{300};
+
 void handle_signal(int sig) {
    // INT can be issued from a terminal only
    if (sig == SIGINT) {
@@ -33,70 +52,156 @@ void handle_signal(int sig) {
    }
 }
 
-bool is_custom_keyboard(toml::table tbl, int vendor_id, int product_id)
-{
-    auto keyboards = tbl["keyboards"].as_array();
-    for (auto &&i : *keyboards) {
-        toml::table *keyboard = i.as_table();
-        if ((*keyboard)["vendor"].value<int64_t>() == vendor_id) {
-            if ((*keyboard)["product"].value<int64_t>() == product_id) {
-                return true;
-            }
+string get_log_path() {
+    return fmt::format("{}/.local/log/kb_detect.log", getenv("HOME"));
+}
+
+// Finds the registers the keyboard is missing or holds different text for, so
+// a keyboard that kept its registers across a re-plug gets almost no traffic.
+// Returns false if the keyboard couldn't say what it holds.
+bool find_changed(transport *dev, const config &cfg, vector<pair<string, string>> &changed) {
+    vector<string> keys;
+    for (auto &reg : cfg.registers) {
+        keys.push_back(reg.first);
+    }
+
+    vector<optional<uint32_t>> held;
+    if (!query_hashes(dev, keys, held)) {
+        return false;
+    }
+
+    for (size_t i = 0; i < cfg.registers.size(); ++i) {
+        if (held[i] != cfg.hashes[i]) {
+            changed.push_back(cfg.registers[i]);
         }
     }
 
-    return false;
+    debug("{} of {} registers need uploading", changed.size(), cfg.registers.size());
+    return true;
 }
 
-string get_config_path() {
-    return string(getenv("HOME")) + "/.kb_detect.toml";
+// Encodes registers for dev, then the K report that selects '.', the way
+// load_config encodes all of [keys], but with 'l' uploads when dev takes them
+void encode_registers(transport *dev, int protocol, const vector<pair<string, string>> &registers,
+                      vector<unsigned char> &out) {
+    if (dev->capabilities & KB_CAP_BATCH) {
+        encode_batch(out, registers, dev->message_size);
+    } else if (protocol >= KB_PROTOCOL_V2 && (dev->capabilities & KB_CAP_LENGTH)) {
+        for (auto &reg : registers) {
+            encode_keyed(out, reg.first, reg.second, dev->message_size);
+        }
+    } else {
+        for (auto &reg : registers) {
+            encode_key(out, reg.first, dev->message_size);
+            encode_data(out, reg.second, protocol, dev->message_size);
+        }
+    }
+    encode_key(out, ".", dev->message_size);
 }
 
-string get_log_path() {
-    return fmt::format("{}/.local/log/kb_detect.log", getenv("HOME"));
-}
+// Where to write the trace, from the trace setting in ~/.kb_detect.toml at startup
+static string trace_path;
 
-void configure_keyboard(toml::table &tbl, struct libusb_device_descriptor &desc) {
-    if (hid_init()) {
-        error("Could not initialize hid");
+// Prometheus textfile rewritten after every keyboard, from [metrics] textfile
+static string metrics_textfile;
+
+// Configures the keyboard whose raw hid interface is at path.  Runs on a worker.
+// keyboard labels its metrics; arrived is when it was plugged in, if it was.
+void configure_device(const config &cfg, const string &path, const string &keyboard,
+                      optional<steady_clock::time_point> arrived) {
+    steady_clock::time_point start = steady_clock::now();
+
+    transport *raw_dev = open_raw_path(path);
+    if (!raw_dev) {
         return;
     }
 
-    hid_device *raw_dev = open_raw(desc.idVendor, desc.idProduct);
+    // Only look the strings up when something will print them
+    bool named = should_log(level::info);
+    std::string vendor = named ? u8enc(raw_dev->vendor()) : std::string();
+    std::string product = named ? u8enc(raw_dev->product()) : std::string();
 
-    if (!raw_dev) {
-        error("Unable to find raw interface to device {:04x}:{:04x}", desc.idVendor, desc.idProduct);
+    int protocol = query_protocol(raw_dev);
 
-        /* Free static HIDAPI objects. */
-        hid_exit();
-        return;
+    const vector<unsigned char> *reports = &cfg.reports(protocol, raw_dev->capabilities, raw_dev->message_size);
+
+    const vector<pair<string, string>> *registers = &cfg.registers;
+
+    vector<pair<string, string>> changed;
+    bool hashed = (raw_dev->capabilities & KB_CAP_HASH) && find_changed(raw_dev, cfg, changed);
+    if (hashed) {
+        registers = &changed;
     }
 
-    std::string vendor = u8enc(get_vendor(raw_dev));
-    std::string product = u8enc(get_product(raw_dev));
+    // The reports encoded by load_config only do when every register is sent as
+    // is, and one at a time only with K
+    upload_plan plan = plan_uploads(raw_dev->limits, *registers);
+    bool keyed = protocol >= KB_PROTOCOL_V2 && (raw_dev->capabilities & (KB_CAP_BATCH | KB_CAP_LENGTH)) == KB_CAP_LENGTH;
+    vector<unsigned char> planned;
+    if (hashed || plan.adjusted || keyed) {
+        encode_registers(raw_dev, protocol, plan.registers, planned);
+        reports = &planned;
+    }
 
-    hid_set_nonblocking(raw_dev, 1);
+    bool ok = send_reports(raw_dev, reports->data(), reports->size() / raw_dev->report_size(), KB_DEFAULT_WINDOW);
+    metrics_record(keyboard, *raw_dev, ok);
 
-    auto keys = tbl["keys"].as_table();
-    for (auto pair : *keys) {
-        string key = string(pair.first.str());
-        string data = pair.second.value_or(""s);
+    rtt_histogram &rtt = raw_dev->rtt;
+    debug("Round trips to {}: {} p50 {}us p99 {}us max {}us", product, rtt.count,
+          rtt.percentile(0.5), rtt.percentile(0.99), rtt.max_us);
 
-        set_key(raw_dev, key);
-        store_data(raw_dev, data);
+    delete raw_dev;
+
+    steady_clock::time_point end = steady_clock::now();
+    auto elapsed = duration_cast<milliseconds>(end - start);
+    info("Initialized {} from {} in {}ms", product, vendor, elapsed.count());
+
+    if (arrived && ok) {
+        metrics_record_ready(keyboard, end - *arrived);
+    }
+    if (metrics_textfile != "") {
+        metrics_write_textfile(metrics_textfile);
     }
 
-    set_key(raw_dev, ".");
+    if (trace_enabled()) {
+        trace_span("configure", start, end);
+        trace_write(trace_path);
+    }
+}
 
-    hid_close(raw_dev);
+// Queues one job for every attached keyboard the profile covers.
+// arrived is when the keyboard was plugged in, if it just was.
+void configure_keyboard(worker_pool &workers, shared_ptr<const config> cfg, const keyboard_profile &profile,
+                        optional<steady_clock::time_point> arrived = nullopt) {
+    vector<string> paths;
+    if (profile.serials.empty()) {
+        paths = find_raw_paths(profile.vendor_id, profile.product_id);
+    } else {
+        for (const wstring &serial : profile.serials) {
+            vector<string> found = find_raw_paths(profile.vendor_id, profile.product_id, serial);
+            paths.insert(paths.end(), found.begin(), found.end());
+        }
+    }
 
-    /* Free static HIDAPI objects. */
-    hid_exit();
+    if (paths.empty()) {
+        error("Unable to find raw interface to device {:04x}:{:04x}", profile.vendor_id, profile.product_id);
+        return;
+    }
 
-    info("Initialized {} from {}", product, vendor);
+    string keyboard = fmt::format("{:04x}:{:04x}", profile.vendor_id, profile.product_id);
+    for (const string &path : paths) {
+        // The job keeps its snapshot alive even if the config is reloaded meanwhile
+        workers.submit([cfg, path, keyboard, arrived] { configure_device(*cfg, path, keyboard, arrived); });
+    }
 }
 
-void configure_if_connected(libusb_context *usb_ctx) {
+// Configures every attached keyboard at once and returns when all are done
+void configure_if_connected(libusb_context *usb_ctx, worker_pool &workers) {
+    shared_ptr<const config> cfg = current_config();
+
+    // Keyboards with the same vid:pid are all found by one profile
+    set<const keyboard_profile *> queued;
+
     libusb_device **usb_devices;
     ssize_t dev_count = libusb_get_device_list(usb_ctx, &usb_devices);
 
@@ -110,23 +215,57 @@ void configure_if_connected(libusb_context *usb_ctx) {
             return;
         }
 
-        auto tbl = toml::parse_file(get_config_path());
-        if (is_custom_keyboard(tbl, desc.idVendor, desc.idProduct)) {
-            configure_keyboard(tbl, desc);
+        const keyboard_profile *profile = cfg->find_keyboard(desc.idVendor, desc.idProduct);
+        if (profile && queued.insert(profile).second) {
+            configure_keyboard(workers, cfg, *profile);
         }
 
     }
 
     libusb_free_device_list(usb_devices, true);
+
+    workers.wait();
+}
+
+// Bus and port numbers of dev, e.g. "1-2.3"
+string usb_location(libusb_device *dev)
+{
+    string location = to_string(libusb_get_bus_number(dev));
+
+    uint8_t ports[7];
+    int count = libusb_get_port_numbers(dev, ports, sizeof(ports));
+    for (int i = 0; i < count; ++i) {
+        location += fmt::format("{}{}", i == 0 ? "-" : ".", ports[i]);
+    }
+    return location;
 }
 
+// Runs on the hotplug_queue thread once arrivals have settled
+void configure_arrivals(worker_pool &workers, const vector<hotplug_queue::arrival> &arrivals)
+{
+    shared_ptr<const config> cfg = current_config();
+
+    for (const hotplug_queue::arrival &a : arrivals) {
+        const keyboard_profile *profile = cfg->find_keyboard(a.id >> 16, a.id & 0xffff);
+        if (profile) {
+            configure_keyboard(workers, cfg, *profile, a.time);
+        }
+    }
+}
+
+// Runs inside libusb_handle_events, so it only queues the device.
 // return 1 to stop listening
 static int LIBUSB_CALL hotplug_callback(libusb_context *ctx, libusb_device *dev, libusb_hotplug_event event, void *user_data)
 {
     // Prevent warnings for unused variables
     (void)ctx;
-    (void)event;
-    (void)user_data;
+
+    hotplug_queue *queue = static_cast<hotplug_queue *>(user_data);
+
+    if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT) {
+        queue->left(usb_location(dev));
+        return 0;
+    }
 
     struct libusb_device_descriptor desc;
     int rc = libusb_get_device_descriptor(dev, &desc); // desc does not need to be freed
@@ -137,10 +276,10 @@ static int LIBUSB_CALL hotplug_callback(libusb_context *ctx, libusb_device *dev,
 
     info("Device attached: {:04x}:{:04x}", desc.idVendor, desc.idProduct);
 
-    toml::table tbl = toml::parse_file(get_config_path());
-
-    if (is_custom_keyboard(tbl, desc.idVendor, desc.idProduct)) {
-        configure_keyboard(tbl, desc);
+    // Checking the config here keeps other devices out of the queue; it is
+    // checked again when the job runs in case it was reloaded meanwhile
+    if (current_config()->find_keyboard(desc.idVendor, desc.idProduct)) {
+        queue->arrived(desc.idVendor, desc.idProduct, usb_location(dev));
     }
 
     return 0;
@@ -171,10 +310,52 @@ int main(int argc, char *argv[])
     debug("Registering Signal Handlers");
     signal(SIGTERM, handle_signal);
     signal(SIGINT, handle_signal);
+    // A metrics scraper that disconnects early must not kill the daemon
+    signal(SIGPIPE, SIG_IGN);
+
+    shared_ptr<const config> cfg = load_config(config_path);
+    if (!cfg) {
+        return 1;
+    }
+    set_current_config(cfg);
+
+    if (auto path = cfg->tbl["trace"].value<string>()) {
+        trace_path = *path;
+        trace_enable("kb_detect");
+        info("Tracing to {}", trace_path);
+    }
+
+    // [metrics] socket serves the metrics, textfile is rewritten for node_exporter
+    unique_ptr<metrics_server> metrics;
+    if (auto socket = cfg->tbl["metrics"]["socket"].value<string>()) {
+        metrics = make_unique<metrics_server>(*socket);
+        info("Serving metrics on {}", *socket);
+    }
+    if (auto textfile = cfg->tbl["metrics"]["textfile"].value<string>()) {
+        metrics_textfile = *textfile;
+        info("Writing metrics to {}", metrics_textfile);
+    }
+
+    debug("Watching {}", config_path);
+    config_watcher watcher(config_path);
 
     debug("Checking HID Version");
     hid_version_check();
 
+    // Once for all workers, hid_init isn't thread safe
+    steady_clock::time_point hid_start = steady_clock::now();
+    if (hid_init()) {
+        error("Could not initialize hid");
+        return EXIT_FAILURE;
+    }
+    trace_span("hid_init", hid_start, steady_clock::now());
+
+    worker_pool workers(worker_count);
+
+    hotplug_queue queue(hotplug_debounce, [&workers](const vector<hotplug_queue::arrival> &arrivals) {
+        configure_arrivals(workers, arrivals);
+    });
+
     libusb_hotplug_callback_handle hp[2];
     int product_id{0}, vendor_id{0}, class_id{0};
 
@@ -188,24 +369,43 @@ int main(int argc, char *argv[])
     if (LIBUSB_SUCCESS != rc)
     {
         error("failed to initialise libusb: {}", libusb_strerror((enum libusb_error)rc));
+        hid_exit();
         return EXIT_FAILURE;
     }
 
     debug("Configuring currently attached keyboards");
-    configure_if_connected(usb_ctx);
+    configure_if_connected(usb_ctx, workers);
 
     debug("Starting USB Listener");
     if (!libusb_has_capability (LIBUSB_CAP_HAS_HOTPLUG)) {
         error("Hotplug capabilities are not supported on this platform");
         libusb_exit(nullptr);
+        queue.stop();
+        workers.wait();
+        hid_exit();
         return EXIT_FAILURE;
     }
 
     rc = libusb_hotplug_register_callback (nullptr, LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED, 0, vendor_id,
-            product_id, class_id, hotplug_callback, nullptr, &hp[0]);
+            product_id, class_id, hotplug_callback, &queue, &hp[0]);
     if (LIBUSB_SUCCESS != rc) {
         error("Error registering callback 0");
         libusb_exit(nullptr);
+        queue.stop();
+        workers.wait();
+        hid_exit();
+        return EXIT_FAILURE;
+    }
+
+    // Cancels a queued arrival when the device is unplugged first
+    rc = libusb_hotplug_register_callback (nullptr, LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT, 0, vendor_id,
+            product_id, class_id, hotplug_callback, &queue, &hp[1]);
+    if (LIBUSB_SUCCESS != rc) {
+        error("Error registering callback 1");
+        libusb_exit(nullptr);
+        queue.stop();
+        workers.wait();
+        hid_exit();
         return EXIT_FAILURE;
     }
 
@@ -223,6 +423,13 @@ int main(int argc, char *argv[])
 
     libusb_exit(nullptr);
 
+    // Nothing may reach the workers once they are drained
+    queue.stop();
+    workers.wait();
+
+    /* Free static HIDAPI objects. */
+    hid_exit();
+
     info("Terminating");
 
     return EXIT_SUCCESS;
@@ -1,7 +1,12 @@
 #include <iostream>
 #include <string>
+#include <fstream>
+#include <filesystem>
 
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include <spdlog/spdlog.h>
 #include <spdlog/cfg/env.h>
@@ -9,45 +14,300 @@
 #include <cxxopts.hpp>
 
 #include "reg.h"
+#include "kb_sim.h"
+#include "regd.h"
 #include "utf8util.h"
+#include "config.h"
+#include "workers.h"
+#include "preflight.h"
+#include "plan.h"
+#include "trace.h"
 
 using namespace std;
 using namespace fmt;
 using namespace spdlog;
 
-static const size_t buf_size{256};
-static unsigned char buf[buf_size];
+// Bytes read from a pipe at a time
+static const size_t chunk_size{4096};
 
 string read_all(FILE *fp) {
-    std::stringstream ss;
+    string data;
+    char chunk[chunk_size];
 
     while (true) {
-        size_t bytes = fread(buf, sizeof(char), buf_size, fp);
+        size_t bytes = fread(chunk, sizeof(char), chunk_size, fp);
+        data.append(chunk, bytes);
 
-        ss.write(reinterpret_cast<char *>(buf), bytes);
+        if (bytes < chunk_size && (feof(fp) || ferror(fp))) {
+            break;
+        }
+    }
+
+    return data;
+}
+
+// A whole file mapped read-only
+struct mapped_file
+{
+    const char *data{nullptr};
+    size_t size{0};
+};
+
+bool map_file(const string &path, mapped_file &file) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        error("Unable to open {}: {}", path, strerror(errno));
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        error("Unable to stat {}: {}", path, strerror(errno));
+        close(fd);
+        return false;
+    }
+
+    file.size = st.st_size;
+    // mmap refuses empty mappings
+    if (file.size > 0) {
+        void *p = mmap(nullptr, file.size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p == MAP_FAILED) {
+            error("Unable to map {}: {}", path, strerror(errno));
+            close(fd);
+            return false;
+        }
+        madvise(p, file.size, MADV_SEQUENTIAL);
+        file.data = static_cast<const char *>(p);
+    }
+
+    close(fd);
+    return true;
+}
+
+void unmap_file(mapped_file &file) {
+    if (file.data != nullptr) {
+        munmap(const_cast<char *>(file.data), file.size);
+    }
+    file = mapped_file();
+}
+
+void report_untypeable(unsigned char c, size_t offset) {
+    error("The keyboard can't type byte 0x{:02x} at offset {}, use --no-check to send it anyway", c, offset);
+}
+
+// Checks data (unless check is false) and escapes it when raw is set.
+// Returns false if the keyboard can't type it.
+bool prepare(string &data, bool raw, bool check) {
+    string escaped;
+    if (raw) {
+        escaped.resize(2 * data.size());
+    }
+
+    preflight_result r = preflight(data.data(), data.size(), raw ? escaped.data() : nullptr);
+    if (check && r.invalid < data.size()) {
+        report_untypeable(data[r.invalid], r.invalid);
+        return false;
+    }
+
+    if (raw) {
+        cout << "Escaping data (" << data << ")" << endl;
+        escaped.resize(data.size() + r.backslashes);
+        data.swap(escaped);
+        cout << "Data: " << data << endl;
+    }
+    return true;
+}
+
+// Checks and writes data to the stream, escaping \ when raw is set.
+// offset counts the bytes written so far.
+bool write_chunk(data_stream &stream, const char *data, size_t size, bool raw, bool check, size_t &offset) {
+    if (!raw && !check) {
+        offset += size;
+        return stream.write(data, size);
+    }
+
+    char escaped[2 * chunk_size];
 
-        if (bytes < buf_size) {
-            if (feof(stdin)) {
-                break;
+    for (size_t done = 0; done < size; ) {
+        size_t len = min(chunk_size, size - done);
+        const char *chunk = data + done;
+
+        preflight_result r = preflight(chunk, len, raw ? escaped : nullptr);
+        if (check && r.invalid < len) {
+            report_untypeable(chunk[r.invalid], offset + r.invalid);
+            return false;
+        }
+
+        bool ok = raw ? stream.write(escaped, len + r.backslashes) : stream.write(chunk, len);
+        if (!ok) {
+            return false;
+        }
+
+        done += len;
+        offset += len;
+    }
+    return true;
+}
+
+// Selects key (when given) and uploads input as it arrives, either from the
+// mapped file or, when that is empty, from stdin.  Input longer than the
+// keyboard can store is cut down when truncate is set and fails otherwise.
+bool upload_stream(transport *dev, const string &key, const mapped_file &file, bool from_file,
+                   bool raw, bool check, bool truncate, int protocol, int window) {
+    if (key != "" && !set_key(dev, key)) {
+        return false;
+    }
+
+    if (protocol == 0) {
+        protocol = query_protocol(dev);
+    }
+
+    data_stream stream(dev, protocol, window, truncate);
+    size_t offset{0};
+
+    // Leaving without finish() leaves the register as it was
+    if (from_file) {
+        // A file's size is known, so one that can never fit isn't sent at all
+        size_t size = file.size;
+        size_t max = max_register_text(dev->limits);
+        if (size > max) {
+            if (!truncate) {
+                error("File is {} bytes, the keyboard can store at most {}", size, max);
+                return false;
             }
+            warn("Truncating file from {} to the {} bytes the keyboard can store", size, max);
+            size = max;
+        }
+
+        // Reports are framed straight from the mapping
+        return write_chunk(stream, file.data, size, raw, check, offset) && stream.finish();
+    }
+
+    char chunk[chunk_size];
+    while (true) {
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        ssize_t bytes = ::read(fileno(stdin), chunk, chunk_size);
+        trace_span("read", start, chrono::steady_clock::now());
+        if (bytes < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes < 0) {
+            error("Unable to read stdin: {}", strerror(errno));
+            return false;
+        }
+        if (bytes == 0) {
+            break;
+        }
+        if (!write_chunk(stream, chunk, bytes, raw, check, offset)) {
+            return false;
         }
     }
 
-    return ss.str();
+    return stream.finish();
 }
 
-// The keyboard will process \ as an escape character
-string escape(string str) {
-    stringstream ss;
-    for (size_t i=0; i<str.length(); ++i) {
-        char c = str[i];
-        if (c == '\\') {
-            ss << "\\\\";
+// Selects key (when given) and stores data.  Asks the keyboard for its protocol when protocol is 0.
+// Data longer than the keyboard can store is cut down when truncate is set and
+// fails before any of it is sent otherwise.
+bool upload(transport *dev, const string &key, const string &data, bool truncate, int protocol, int window) {
+    if (protocol == 0) {
+        protocol = query_protocol(dev);
+    }
+
+    upload_plan plan = plan_uploads(dev->limits, {{key != "" ? key : "data", data}}, truncate);
+    return !plan.registers.empty() && store_register(dev, key, plan.registers.front().second, protocol, window);
+}
+
+// One keyboard of --all
+struct keyboard_upload
+{
+    string path;
+    string product;
+    bool opened{false};
+    bool ok{false};
+    rtt_histogram rtt;
+};
+
+// Keyboards open_raw should look for.  Without -v and -p that is every keyboard
+// in ~/.kb_detect.toml first, so finding one doesn't enumerate every hid
+// device, and only then any keyboard at all.
+vector<uint32_t> keyboard_ids(int vendor_id, int product_id)
+{
+    vector<uint32_t> ids;
+    if (vendor_id == 0 && product_id == 0 && filesystem::exists(get_config_path())) {
+        ids = load_keyboard_ids(get_config_path());
+    }
+    ids.push_back(uint32_t(vendor_id) << 16 | uint32_t(product_id));
+    return ids;
+}
+
+// Stores data on every attached keyboard in the kb_detect config, each on its own worker
+int upload_all(const string &key, const string &data, bool truncate, int protocol, int window, bool show_rtt) {
+    shared_ptr<const config> cfg = load_config(get_config_path());
+    if (!cfg) {
+        return -103;
+    }
+
+    vector<keyboard_upload> uploads;
+    for (auto &i : cfg->keyboards) {
+        const keyboard_profile &profile = i.second;
+        vector<wstring> serials = profile.serials;
+        if (serials.empty()) {
+            serials.push_back(L"");
+        }
+        for (const wstring &serial : serials) {
+            for (const string &path : find_raw_paths(profile.vendor_id, profile.product_id, serial)) {
+                keyboard_upload u;
+                u.path = path;
+                uploads.push_back(u);
+            }
+        }
+    }
+
+    if (uploads.empty()) {
+        error("None of the keyboards in {} are attached", cfg->path);
+        return -101;
+    }
+
+    {
+        worker_pool workers(uploads.size());
+        for (keyboard_upload &u : uploads) {
+            workers.submit([&u, &key, &data, truncate, protocol, window] {
+                transport *dev = open_raw_path(u.path);
+                if (!dev) {
+                    return;
+                }
+                u.opened = true;
+                u.product = u8enc(dev->product());
+                {
+                    trace_scope span("upload");
+                    u.ok = upload(dev, key, data, truncate, protocol, window);
+                }
+                u.rtt = dev->rtt;
+                delete dev;
+            });
+        }
+        workers.wait();
+    }
+
+    int exit_status = 0;
+    for (const keyboard_upload &u : uploads) {
+        if (!u.opened) {
+            exit_status = -101;
+            continue;
+        }
+        if (!u.ok) {
+            error("Unable to store data on {} ({})", u.product, u.path);
+            exit_status = -102;
         } else {
-            ss << c;
+            debug("Stored data on {} ({})", u.product, u.path);
+        }
+        if (show_rtt) {
+            printf("%s (%s)\n", u.product.c_str(), u.path.c_str());
+            u.rtt.print(stdout);
         }
     }
-    return ss.str();
+    return exit_status;
 }
 
 int main(int argc, char* argv[])
@@ -66,15 +326,47 @@ int main(int argc, char* argv[])
 
     string key;
     bool raw;
+    bool no_check;
+    bool truncate;
     int vendor_id{0};
     int product_id{0};
+    int protocol{0};
+    int window{KB_DEFAULT_WINDOW};
+    bool show_rtt;
+    string rtt_csv;
+    string trace_path;
+    bool sim;
+    int sim_latency{1000};
+    int sim_jitter{0};
+    int sim_loss{0};
+    int sim_protocol{KB_PROTOCOL_V2};
+    int sim_report_size{KB_MESSAGE_SIZE};
+    bool direct;
+    bool all;
+    string file_path;
 
     options.add_options()
         ("h,help", "displays help text")
         ("k,key", "specifies register", cxxopts::value(key)->default_value(""))
+        ("f,file", "stores the contents of this file", cxxopts::value(file_path))
         ("r,raw", "Escapes \\ characters", cxxopts::value(raw))
+        ("no-check", "sends bytes the keyboard can't type", cxxopts::value(no_check))
+        ("t,truncate", "cuts data down to what the keyboard can store instead of failing", cxxopts::value(truncate))
         ("v,vendor", "specifies vendor id", cxxopts::value(vendor_id))
         ("p,product", "specifies product id", cxxopts::value(product_id))
+        ("P,protocol", "forces protocol version (0 asks the keyboard)", cxxopts::value(protocol))
+        ("w,window", "reports in flight for protocol v2", cxxopts::value(window))
+        ("rtt", "prints a histogram of report round trip times", cxxopts::value(show_rtt))
+        ("rtt-csv", "writes report round trip times to a csv file", cxxopts::value(rtt_csv))
+        ("trace", "writes a Chrome trace of every phase and report to a file", cxxopts::value(trace_path))
+        ("d,direct", "talks to the keyboard even when kb_regd is running", cxxopts::value(direct))
+        ("a,all", "stores the data on every attached keyboard in ~/.kb_detect.toml", cxxopts::value(all))
+        ("sim", "sends to a simulated keyboard instead of hardware", cxxopts::value(sim))
+        ("sim-latency", "simulated reply latency in microseconds", cxxopts::value(sim_latency))
+        ("sim-jitter", "simulated reply jitter in microseconds", cxxopts::value(sim_jitter))
+        ("sim-loss", "percentage of simulated reports and replies that are lost", cxxopts::value(sim_loss))
+        ("sim-protocol", "highest protocol the simulated keyboard speaks", cxxopts::value(sim_protocol))
+        ("sim-report-size", "bytes per report of the simulated keyboard, 32 or 64", cxxopts::value(sim_report_size))
         ;
 
     auto result = options.parse(argc, argv);
@@ -85,22 +377,49 @@ int main(int argc, char* argv[])
         return 0;
     }
 
-    string data = "";
+    if (all && (sim || rtt_csv != "")) {
+        error("--all can't be combined with --sim or --rtt-csv");
+        return 1;
+    }
+
+    if (trace_path != "") {
+        trace_enable("kb_reg");
+    }
 
     vector args = result.unmatched();
-    if (args.size() > 0) {
+
+    // kb_regd fails data that is too long, it never truncates
+    bool use_regd = !direct && !all && !sim && !show_rtt && !truncate && rtt_csv == "" && trace_path == "";
+    bool from_file = file_path != "";
+    // Input that doesn't have to be in memory first is sent while it is read
+    bool stream = !use_regd && !all && args.empty() && (from_file || !isatty(fileno(stdin)));
+
+    mapped_file file;
+    if (from_file && !map_file(file_path, file)) {
+        return 1;
+    }
+
+    string data = "";
+
+    if (stream) {
+        debug("Streaming {}", from_file ? file_path : "stdin");
+    } else if (from_file) {
+        if (file.size > 0) {
+            data.assign(file.data, file.size);
+        }
+    } else if (args.size() > 0) {
         // Take all (unmatched) arguments and append them to make the data
         bool first = true;
-        std::stringstream ss;
         for (const string &arg : args) {
             if (!first) {
-                ss << " ";
+                data += " ";
             }
-            ss << arg;
+            data += arg;
+            first = false;
         }
-        data = ss.str();
     } else {
         if (!isatty(fileno(stdin))) {
+            trace_scope span("read");
             data = read_all(stdin);
         } else {
             cout << "Input what you'd like to copy to the Keyboard ->";
@@ -108,41 +427,114 @@ int main(int argc, char* argv[])
         }
     }
 
-    if (raw) {
-        cout << "Escaping data (" << data << ")" << endl;
-        data = escape(data);
-        cout << "Data: " << data << endl;
+    // Reject what the keyboard can't type before any USB traffic
+    if (!stream && !prepare(data, raw, !no_check)) {
+        return 1;
+    }
+    // A mapped file is checked whole here, so it isn't checked again as it is sent
+    bool check_stream = !no_check && !from_file;
+    if (stream && from_file && !no_check) {
+        preflight_result r = preflight(file.data, file.size);
+        if (r.invalid < file.size) {
+            report_untypeable(file.data[r.invalid], r.invalid);
+            return 1;
+        }
+    }
+
+    // Hand the upload to kb_regd when it's running, it already has the keyboard open
+    if (use_regd) {
+        regd_request request;
+        request.vendor_id = vendor_id;
+        request.product_id = product_id;
+        request.protocol = protocol;
+        request.window = window;
+        request.key = key;
+        request.data = data;
+
+        string reply;
+        if (regd_send(request, reply)) {
+            if (reply != "OK") {
+                error("kb_regd: {}", reply);
+                return -102;
+            }
+            debug("Stored by kb_regd");
+            return 0;
+        }
     }
 
     hid_version_check();
 
-    if (hid_init()) {
-        return -100;
+    {
+        trace_scope span("hid_init");
+        if (hid_init()) {
+            return -100;
+        }
+    }
+
+    if (all) {
+        exit_status = upload_all(key, data, truncate, protocol, window, show_rtt);
+
+        /* Free static HIDAPI objects. */
+        hid_exit();
+
+        if (trace_path != "") {
+            trace_write(trace_path);
+        }
+        return exit_status;
     }
 
-    hid_device *raw_dev = open_raw(vendor_id, product_id);
+    transport *raw_dev;
+    if (sim) {
+        kb_sim_options sim_options;
+        sim_options.latency = chrono::microseconds(sim_latency);
+        sim_options.jitter = chrono::microseconds(sim_jitter);
+        sim_options.loss = sim_loss;
+        sim_options.protocol = sim_protocol;
+        sim_options.report_size = sim_report_size == KB_LARGE_MESSAGE_SIZE ? KB_LARGE_MESSAGE_SIZE : KB_MESSAGE_SIZE;
+        raw_dev = new kb_sim(sim_options);
+    } else {
+        raw_dev = open_raw(keyboard_ids(vendor_id, product_id));
+    }
 
     if (raw_dev) {
-        string vendor = u8enc(get_vendor(raw_dev));
-        string product = u8enc(get_product(raw_dev));
-        debug("Found {} from {}", product, vendor);
+        if (should_log(level::debug)) {
+            debug("Found {} from {}", u8enc(raw_dev->product()), u8enc(raw_dev->vendor()));
+        }
 
-        // Set the hid_read() function to be non-blocking.
-        hid_set_nonblocking(raw_dev, 1);
+        bool ok;
+        {
+            trace_scope span("upload");
+            if (stream) {
+                ok = upload_stream(raw_dev, key, file, from_file, raw, check_stream, truncate, protocol, window);
+            } else {
+                ok = upload(raw_dev, key, data, truncate, protocol, window);
+            }
+        }
+        if (!ok) {
+            exit_status = -102;
+        }
 
-        if (key != "") {
-            set_key(raw_dev, key);
+        if (show_rtt) {
+            raw_dev->rtt.print(stdout);
         }
 
-        store_data(raw_dev, data);
+        if (rtt_csv != "") {
+            ofstream csv(rtt_csv);
+            raw_dev->rtt.write_csv(csv);
+        }
 
-        hid_close(raw_dev);
+        delete raw_dev;
     } else {
         exit_status = -101;
     }
 
+    unmap_file(file);
+
     /* Free static HIDAPI objects. */
     hid_exit();
 
+    if (trace_path != "") {
+        trace_write(trace_path);
+    }
     return exit_status;
 }
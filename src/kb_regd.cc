@@ -0,0 +1,307 @@
+#include <iostream>
+#include <string>
+#include <map>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include <spdlog/spdlog.h>
+#include <spdlog/cfg/env.h>
+#include <hidapi.h>
+#include <cxxopts.hpp>
+
+#include "reg.h"
+#include "regd.h"
+#include "kb_sim.h"
+#include "utf8util.h"
+#include "trace.h"
+
+using namespace std;
+using namespace std::filesystem;
+using namespace fmt;
+using namespace spdlog;
+
+volatile bool exit_flag{false};
+
+void handle_signal(int sig) {
+   if (sig == SIGINT || sig == SIGTERM) {
+      exit_flag=true;
+   }
+}
+
+string get_log_path() {
+    return fmt::format("{}/.local/log/kb_regd.log", getenv("HOME"));
+}
+
+// A keyboard whose raw hid interface stays open between requests
+struct open_keyboard
+{
+    transport *dev;
+    int protocol;
+};
+
+static map<pair<int, int>, open_keyboard> keyboards;
+static bool simulate{false};
+
+open_keyboard *find_keyboard(int vendor_id, int product_id)
+{
+    auto id = make_pair(vendor_id, product_id);
+
+    auto i = keyboards.find(id);
+    if (i != keyboards.end()) {
+        return &i->second;
+    }
+
+    transport *dev;
+    if (simulate) {
+        dev = new kb_sim(kb_sim_options());
+    } else {
+        dev = open_raw(vendor_id, product_id);
+    }
+    if (!dev) {
+        return nullptr;
+    }
+
+    open_keyboard kb;
+    kb.dev = dev;
+    kb.protocol = query_protocol(dev);
+
+    if (should_log(level::info)) {
+        info("Opened {} from {} (protocol v{})", u8enc(dev->product()), u8enc(dev->vendor()), kb.protocol);
+    }
+
+    return &keyboards.insert(make_pair(id, kb)).first->second;
+}
+
+void close_keyboard(int vendor_id, int product_id)
+{
+    auto i = keyboards.find(make_pair(vendor_id, product_id));
+    if (i != keyboards.end()) {
+        delete i->second.dev;
+        keyboards.erase(i);
+    }
+}
+
+void close_all_keyboards()
+{
+    for (auto &i : keyboards) {
+        delete i.second.dev;
+    }
+    keyboards.clear();
+}
+
+string serve(const regd_request &request, int default_window)
+{
+    int window = request.window > 0 ? request.window : default_window;
+
+    // A handle kept open across an unplug fails on first use, so reopen once.
+    // An error the keyboard answered with would only come back again.
+    for (int attempt = 0; attempt < 2; ++attempt) {
+        open_keyboard *kb = find_keyboard(request.vendor_id, request.product_id);
+        if (!kb) {
+            return fmt::format("ERR Unable to find raw interface to device {:04x}:{:04x}",
+                               request.vendor_id, request.product_id);
+        }
+
+        int protocol = request.protocol > 0 ? request.protocol : kb->protocol;
+
+        transport *dev = kb->dev;
+        uint64_t failures = dev->failures;
+        uint64_t overflows = dev->overflows;
+        uint64_t out_of_memory = dev->out_of_memory;
+
+        bool ok = store_register(dev, request.key, request.data, protocol, window);
+        if (ok) {
+            debug("Stored {} bytes", request.data.size());
+            return "OK";
+        }
+
+        if (dev->failures == failures) {
+            if (dev->overflows != overflows) {
+                return "ERR Overflow";
+            }
+            if (dev->out_of_memory != out_of_memory) {
+                return "ERR Out of Memory";
+            }
+            return "ERR Keyboard rejected the upload";
+        }
+
+        warn("Upload to {:04x}:{:04x} failed, reopening", request.vendor_id, request.product_id);
+        close_keyboard(request.vendor_id, request.product_id);
+    }
+
+    return "ERR Upload failed";
+}
+
+// Binds the listening socket, replacing a stale socket file left by a crashed daemon
+int listen_on(const string &path)
+{
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path)) {
+        error("Socket path is too long: {}", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path.c_str());
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        error("Unable to create socket: {}", strerror(errno));
+        return -1;
+    }
+
+    if (connect(fd, (sockaddr *)&addr, sizeof(addr)) == 0) {
+        error("kb_regd is already listening on {}", path);
+        close(fd);
+        return -1;
+    }
+    close(fd);
+    unlink(path.c_str());
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        error("Unable to create socket: {}", strerror(errno));
+        return -1;
+    }
+
+    // Only the user running the daemon may upload.  The socket is created
+    // that way rather than changed after bind, when anyone could connect.
+    mode_t mask = umask(0177);
+    int res = ::bind(fd, (sockaddr *)&addr, sizeof(addr));
+    umask(mask);
+    if (res < 0) {
+        error("Unable to bind {}: {}", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    if (listen(fd, 8) < 0) {
+        error("Unable to listen on {}: {}", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+int main(int argc, char *argv[])
+{
+    cxxopts::Options options(argv[0], "Keeps keyboards open and stores data sent by kb_reg");
+
+    string socket_path = get_socket_path();
+    int window{KB_DEFAULT_WINDOW};
+    string trace_path;
+
+    options.add_options()
+        ("h,help", "displays help text")
+        ("s,socket", "path of the unix socket", cxxopts::value(socket_path))
+        ("w,window", "reports in flight for protocol v2", cxxopts::value(window))
+        ("sim", "serves a simulated keyboard instead of hardware", cxxopts::value(simulate))
+        ("trace", "writes a Chrome trace of every request to a file", cxxopts::value(trace_path))
+        ;
+
+    auto result = options.parse(argc, argv);
+
+    if (result.count("help"))
+    {
+        cout << options.help() << endl;
+        return 0;
+    }
+
+    string log_folder_path = path(get_log_path()).parent_path();
+    if (!exists(log_folder_path)) {
+        cout << fmt::format("You must run: mkdir -p {}", log_folder_path) << endl;
+        return 1;
+    }
+
+    if (!isatty(fileno(stdout))) {
+        // configure spdlog to write to this logfile
+        string logpath = get_log_path();
+        std::freopen(logpath.c_str(), "w", stdout);
+    }
+
+    spdlog::cfg::load_env_levels();
+
+    debug("Registering Signal Handlers");
+    signal(SIGTERM, handle_signal);
+    signal(SIGINT, handle_signal);
+    // A client that disconnects early must not kill the daemon
+    signal(SIGPIPE, SIG_IGN);
+
+    if (trace_path != "") {
+        trace_enable("kb_regd");
+    }
+
+    if (socket_path == "") {
+        error("No private directory for the socket: set XDG_RUNTIME_DIR, or pass -s");
+        return EXIT_FAILURE;
+    }
+
+    hid_version_check();
+
+    if (hid_init()) {
+        error("Could not initialize hid");
+        return EXIT_FAILURE;
+    }
+
+    int listen_fd = listen_on(socket_path);
+    if (listen_fd < 0) {
+        hid_exit();
+        return EXIT_FAILURE;
+    }
+
+    info("Listening on {}", socket_path);
+
+    while (!exit_flag) {
+        // Wake up regularly to notice SIGINT/SIGTERM
+        pollfd pfd{listen_fd, POLLIN, 0};
+        if (poll(&pfd, 1, 500) <= 0) {
+            continue;
+        }
+
+        int client = accept(listen_fd, nullptr, nullptr);
+        if (client < 0) {
+            continue;
+        }
+
+        // Don't let a stalled client block everyone else
+        timeval timeout{2, 0};
+        setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+        regd_request request;
+        if (regd_read_request(client, request)) {
+            {
+                trace_scope span("serve");
+                regd_write_reply(client, serve(request, window));
+            }
+            if (trace_path != "") {
+                trace_write(trace_path);
+            }
+        } else {
+            regd_write_reply(client, "ERR Malformed request");
+        }
+
+        close(client);
+    }
+
+    close(listen_fd);
+    unlink(socket_path.c_str());
+
+    close_all_keyboards();
+
+    /* Free static HIDAPI objects. */
+    hid_exit();
+
+    info("Terminating");
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,540 @@
+#include "kb_sim.h"
+
+#include <algorithm>
+#include <cstdarg>
+#include <cstdio>
+#include <cstring>
+#include <thread>
+
+#include <spdlog/spdlog.h>
+
+#include "reg.h"
+#include "crc32.h"
+
+using namespace std;
+using namespace std::chrono;
+using namespace spdlog;
+
+// dprintf of the firmware modules
+extern "C" void kb_fw_log(const char *format, ...)
+{
+    char message[256];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(message, sizeof(message), format, args);
+    va_end(args);
+
+    size_t length = strlen(message);
+    if (length > 0 && message[length - 1] == '\n') {
+        message[length - 1] = 0;
+    }
+    trace("kb_sim firmware: {}", message);
+}
+
+kb_sim::kb_sim(const kb_sim_options &options)
+    : options(options), rng(random_device{}()), arena(min<size_t>(options.heap, KB_REGISTERS_ARENA_MAX))
+{
+    kb_registers_init(&registers, arena.data(), arena.size());
+    memset(kb_register_buffer, 0, sizeof(kb_register_buffer));
+    lz_decoder_init(&decoder);
+}
+
+kb_sim::~kb_sim()
+{
+    // The registers live in arena and go with it
+}
+
+int kb_sim::write(const unsigned char *data, size_t length)
+{
+    if (length < 1 || data[0] != 0x0) {
+        return -1;
+    }
+
+    if (lost()) {
+        return length;
+    }
+
+    // The firmware always sees a full report, zero padded
+    uint8_t report[KB_SIM_REPORT_SIZE] = {};
+    memcpy(report, data + 1, min<size_t>(length - 1, options.report_size));
+
+    raw_hid_receive(report, options.report_size);
+
+    return length;
+}
+
+int kb_sim::read_timeout(unsigned char *data, size_t length, int milliseconds)
+{
+    if (replies.empty()) {
+        if (milliseconds > 0) {
+            this_thread::sleep_for(std::chrono::milliseconds(milliseconds));
+        }
+        // A blocking read would never return, so report a timeout instead
+        return 0;
+    }
+
+    steady_clock::time_point deadline = steady_clock::now() + std::chrono::milliseconds(max(milliseconds, 0));
+    if (milliseconds >= 0 && replies.front().ready > deadline) {
+        this_thread::sleep_until(deadline);
+        return 0;
+    }
+
+    this_thread::sleep_until(replies.front().ready);
+
+    size_t n = min<size_t>(length, replies.front().length);
+    memcpy(data, replies.front().data, n);
+    replies.pop_front();
+
+    return n;
+}
+
+wstring kb_sim::vendor()
+{
+    return L"kb_reg";
+}
+
+wstring kb_sim::product()
+{
+    return L"Simulated Keyboard";
+}
+
+wstring kb_sim::error()
+{
+    return L"Simulated keyboard error";
+}
+
+size_t kb_sim::descriptor_message_size()
+{
+    return options.report_size;
+}
+
+int kb_sim::remembered_protocol()
+{
+    return options.protocol;
+}
+
+const char *kb_sim::get_register(char key) const
+{
+    return reinterpret_cast<const char *>(kb_registers_get(&registers, key, nullptr));
+}
+
+// Queues a reply that becomes readable after the simulated latency
+bool kb_sim::lost()
+{
+    return options.loss > 0 && uniform_int_distribution<int>(0, 99)(rng) < options.loss;
+}
+
+void kb_sim::raw_hid_send(uint8_t *data, uint8_t length)
+{
+    if (lost()) {
+        return;
+    }
+
+    reply r;
+    memset(r.data, 0, sizeof(r.data));
+    memcpy(r.data, data, min<size_t>(length, KB_SIM_REPORT_SIZE));
+    r.length = min<size_t>(length, KB_SIM_REPORT_SIZE);
+
+    microseconds delay = options.latency;
+    if (options.jitter.count() > 0) {
+        uniform_int_distribution<long> dist(-options.jitter.count(), options.jitter.count());
+        delay += microseconds(dist(rng));
+    }
+    r.ready = steady_clock::now() + max(delay, microseconds(0));
+
+    // Replies leave the keyboard in order
+    if (!replies.empty()) {
+        r.ready = max(r.ready, replies.back().ready);
+    }
+
+    replies.push_back(r);
+}
+
+void kb_sim::send_raw_hid_response(const char *msg, uint8_t length)
+{
+    uint8_t response[KB_SIM_REPORT_SIZE] = {};
+    strncpy((char *)response, msg, sizeof(response) - 1);
+    raw_hid_send(response, length);
+}
+
+void kb_sim::send_raw_hid_ack(uint8_t seq, const char *msg, uint8_t length)
+{
+    uint8_t response[KB_SIM_REPORT_SIZE] = {};
+    response[0] = '#';
+    response[1] = seq;
+    strncpy((char *)&response[2], msg, sizeof(response) - 3);
+    memcpy(last_ack, response, sizeof(last_ack));
+    last_ack_length = length;
+    raw_hid_send(response, length);
+}
+
+const char *kb_sim::start_register(const uint8_t *data, uint8_t length)
+{
+    // Reinitialize kb_register to wipe out all appended data (past length)
+    memset(kb_register_buffer, 0, sizeof(kb_register_buffer));
+    kb_register_buffer_offset = 0;
+    lz_decoder_init(&decoder);
+
+    return append_register(data, length);
+}
+
+const char *kb_sim::append_register(const uint8_t *data, uint8_t length)
+{
+    for (int i=0; i<length; i++) {
+        if (data[i] == 0) {
+            break;
+        }
+        if (kb_register_buffer_offset >= KB_SIM_BUFFER_MAX) {
+            return "Overflow";
+        }
+        kb_register_buffer[kb_register_buffer_offset++] = data[i];
+    }
+    return "OK";
+}
+
+// Decodes the payload of a z or c report into the register buffer
+const char *kb_sim::decode_register(const uint8_t *data, uint8_t length)
+{
+    uint8_t len = min<uint8_t>(data[0], length - 1);
+
+    if (decoder_status == LZ_OK) {
+        size_t offset = kb_register_buffer_offset;
+        decoder_status = lz_decode(&decoder, &data[1], len, (uint8_t *) kb_register_buffer,
+                                   &offset, KB_SIM_BUFFER_MAX);
+        kb_register_buffer_offset = offset;
+    }
+
+    switch (decoder_status) {
+    case LZ_OK:
+        return "OK";
+    case LZ_OVERFLOW:
+        return "Overflow";
+    default:
+        return "Bad Data";
+    }
+}
+
+const char *kb_sim::finish_register()
+{
+    if (!lz_decoder_done(&decoder)) {
+        lz_decoder_init(&decoder);
+        return "Bad Data";
+    }
+
+    size_t size = kb_register_buffer_offset + 1; // add for one zero
+    int handle = kb_registers_reserve(&registers, kb_register_next_keycode, size);
+    if (handle < 0) {
+        return "Out of Memory";
+    }
+
+    // Copy data with one zero
+    memcpy(kb_registers_data(&registers, handle), kb_register_buffer, size);
+
+    commit_register(kb_register_next_keycode, handle);
+    return "OK";
+}
+
+// Makes the register reserved for keycode its contents
+void kb_sim::commit_register(uint16_t keycode, int handle)
+{
+    kb_registers_commit(&registers, handle);
+
+    size_t size;
+    const uint8_t *data = kb_registers_get(&registers, keycode, &size);
+    hashes[keycode & 0xff] = crc32(data, size - 1);
+}
+
+// l is key, 16 bit little endian length, then the first bytes.  The register
+// is allocated once here and filled in place, so there is no staging buffer to
+// clear or copy out of, and zeros are stored like any other byte.  Once
+// something failed, every report up to f gets the same error.
+const char *kb_sim::start_in_place(const uint8_t *data, uint8_t length)
+{
+    abort_in_place();
+
+    size_t size = data[1] | data[2] << 8;
+    if (size > KB_SIM_BUFFER_MAX) {
+        in_place_status = "Overflow";
+        return in_place_status;
+    }
+
+    in_place_keycode = data[0] != 0 ? data[0] : kb_register_next_keycode;
+    in_place_handle = kb_registers_reserve(&registers, in_place_keycode, size + 1);
+    if (in_place_handle < 0) {
+        in_place_status = "Out of Memory";
+        return in_place_status;
+    }
+    // A zero after the data keeps SEND_STRING from running off its end
+    kb_registers_data(&registers, in_place_handle)[size] = 0;
+    in_place_size = size;
+    in_place_offset = 0;
+    in_place_status = "OK";
+
+    return append_in_place(&data[3], length - 3);
+}
+
+const char *kb_sim::append_in_place(const uint8_t *data, uint8_t length)
+{
+    if (in_place_handle >= 0) {
+        size_t len = min<size_t>(length, in_place_size - in_place_offset);
+        memcpy(kb_registers_data(&registers, in_place_handle) + in_place_offset, data, len);
+        in_place_offset += len;
+    }
+    return in_place_status;
+}
+
+const char *kb_sim::finish_in_place()
+{
+    const char *status = in_place_status;
+    if (in_place_handle >= 0 && in_place_offset < in_place_size) {
+        status = "Bad Data";
+    }
+    if (strcmp(status, "OK") == 0) {
+        commit_register(in_place_keycode, in_place_handle);
+        in_place_handle = -1;
+    }
+
+    abort_in_place();
+    return status;
+}
+
+// Ends an upload written in place, dropping what it wrote
+void kb_sim::abort_in_place()
+{
+    if (in_place_handle >= 0) {
+        kb_registers_drop(&registers, in_place_handle);
+        in_place_handle = -1;
+    }
+    in_place_status = nullptr;
+}
+
+// Replies to H with 'H', the number of keys, a bit per key that has a
+// register, then a little endian hash per key
+void kb_sim::send_hashes(const uint8_t *data, uint8_t length)
+{
+    uint8_t n = min<uint8_t>(data[1], KB_HASH_MAX_KEYS);
+
+    uint8_t response[KB_SIM_REPORT_SIZE] = {};
+    response[0] = 'H';
+    response[1] = n;
+
+    for (uint8_t i = 0; i < n; ++i) {
+        uint8_t keycode = data[2 + i];
+        if (kb_registers_get(&registers, keycode, nullptr) == nullptr) {
+            continue;
+        }
+        response[2] |= 1 << i;
+        for (int b = 0; b < 4; ++b) {
+            response[3 + 4 * i + b] = (hashes[keycode] >> (8 * b)) & 0xff;
+        }
+    }
+
+    raw_hid_send(response, length);
+}
+
+// Drops whatever an unfinished batch staged
+void kb_sim::begin_batch()
+{
+    for (staged_register &s : batch) {
+        if (s.handle >= 0) {
+            kb_registers_drop(&registers, s.handle);
+        }
+    }
+    batch.clear();
+    batch_open = true;
+    batch_record_open = false;
+}
+
+// Copies the record in kb_register_buffer out so the buffer can take the next one
+void kb_sim::stage_register()
+{
+    staged_register s{batch_keycode, -1, batch_status};
+
+    if (s.status == KB_STATUS_OK) {
+        size_t size = kb_register_buffer_offset + 1; // add for one zero
+        s.handle = kb_registers_reserve(&registers, batch_keycode, size);
+        if (s.handle < 0) {
+            s.status = KB_STATUS_OUT_OF_MEMORY;
+        } else {
+            memcpy(kb_registers_data(&registers, s.handle), kb_register_buffer, size);
+        }
+    }
+
+    batch.push_back(s);
+    batch_record_open = false;
+}
+
+// Stores every staged register and replies with '$', the sequence number of
+// C, the number of records, then one status per record
+void kb_sim::commit_batch(uint8_t seq, uint8_t length)
+{
+    if (batch_record_open) {
+        stage_register();
+    }
+
+    uint8_t response[KB_SIM_REPORT_SIZE] = {};
+    response[0] = '$';
+    response[1] = seq;
+    response[2] = (uint8_t) min<size_t>(batch.size(), KB_BATCH_MAX_RECORDS);
+
+    for (size_t i = 0; i < batch.size(); ++i) {
+        staged_register &s = batch[i];
+        // Room for it was reserved when it was staged, so storing can't fail
+        if (s.status == KB_STATUS_OK) {
+            commit_register(s.keycode, s.handle);
+        }
+        if (i < KB_BATCH_MAX_RECORDS) {
+            response[3 + i] = s.status;
+        }
+    }
+
+    batch.clear();
+    batch_open = false;
+
+    memcpy(last_ack, response, sizeof(last_ack));
+    last_ack_length = length;
+    raw_hid_send(response, length);
+}
+
+// Same semantics as the firmware in README.md, except keycodes are the ASCII
+// value of the key rather than the result of ascii_to_keycode_lut.
+void kb_sim::raw_hid_receive(uint8_t *data, uint8_t length)
+{
+    trace("kb_sim received {:c}", (char)data[0]);
+
+    if (data[0] == 'K') { // Set Key
+        kb_register_next_keycode = data[1];
+        send_raw_hid_response("OK", length);
+        return;
+
+    } else if (data[0] == 'S') { // Initial set
+        start_register(&data[1], length - 1);
+        send_raw_hid_response("OK", length);
+        return;
+
+    } else if (data[0] == 'A') { // Append
+        send_raw_hid_response(append_register(&data[1], length - 1), length);
+        return;
+
+    } else if (data[0] == 'F') { // Finish (Store written register)
+        send_raw_hid_response(finish_register(), length);
+        return;
+    }
+
+    if (options.protocol < KB_PROTOCOL_V2) {
+        // Old firmware ignores everything else, including V
+        return;
+    }
+
+    if (data[0] == 'V') { // Protocol version
+        uint8_t response[KB_SIM_REPORT_SIZE] = {};
+        response[0] = 'V';
+        response[1] = KB_PROTOCOL_V2;
+        response[2] = options.capabilities;
+        if (options.report_size == KB_LARGE_MESSAGE_SIZE) {
+            response[2] |= KB_CAP_REPORT64;
+        }
+        if (options.capabilities & KB_CAP_LIMITS) {
+            size_t free_memory = kb_registers_free(&registers);
+            response[3] = options.report_size;
+            response[4] = KB_SIM_BUFFER_MAX & 0xff;
+            response[5] = KB_SIM_BUFFER_MAX >> 8;
+            for (int b = 0; b < 4; ++b) {
+                response[6 + b] = (free_memory >> (8 * b)) & 0xff;
+            }
+        }
+        raw_hid_send(response, length);
+        return;
+
+    } else if (data[0] == 'H' && (options.capabilities & KB_CAP_HASH)) { // Register hashes
+        send_hashes(data, length);
+        return;
+
+    } else if (data[0] == 's' || data[0] == 'a' || data[0] == 'f' ||
+               ((options.capabilities & KB_CAP_LENGTH) && data[0] == 'l') ||
+               ((options.capabilities & KB_CAP_LZ) && (data[0] == 'z' || data[0] == 'c')) ||
+               ((options.capabilities & KB_CAP_BATCH) &&
+                (data[0] == 'B' || data[0] == 'r' || data[0] == 'C'))) {
+        uint8_t seq = data[1];
+
+        if (data[0] == 's' || data[0] == 'l' || data[0] == 'z' || data[0] == 'B') {
+            next_seq = seq;
+        } else if (seq != next_seq) {
+            // Duplicate or out of order; repeat the reply to the last report
+            // processed, which for C is the batch summary
+            if (last_ack_length > 0) {
+                raw_hid_send(last_ack, last_ack_length);
+            } else {
+                send_raw_hid_ack(next_seq - 1, "OK", length);
+            }
+            return;
+        }
+        next_seq = seq + 1;
+
+        if (data[0] == 'B') {
+            abort_in_place();
+            begin_batch();
+            send_raw_hid_ack(seq, "OK", length);
+            return;
+        } else if (data[0] == 'C') {
+            abort_in_place();
+            commit_batch(seq, length);
+            return;
+        } else if (data[0] == 'r' || (data[0] == 'a' && batch_open)) {
+            // Problems with a record are reported in the summary, so the
+            // frames themselves are always acknowledged
+            if (data[0] == 'r') {
+                if (batch_record_open) {
+                    stage_register();
+                }
+                batch_record_open = true;
+                batch_keycode = data[2];
+                batch_status = KB_STATUS_OK;
+                memset(kb_register_buffer, 0, sizeof(kb_register_buffer));
+                kb_register_buffer_offset = 0;
+            }
+
+            const uint8_t *payload = data[0] == 'r' ? &data[3] : &data[2];
+            uint8_t payload_length = data[0] == 'r' ? length - 3 : length - 2;
+            if (batch_status == KB_STATUS_OK && strcmp(append_register(payload, payload_length), "OK") != 0) {
+                batch_status = KB_STATUS_OVERFLOW;
+            }
+
+            send_raw_hid_ack(seq, "OK", length);
+            return;
+        }
+
+        const char *status;
+        if (data[0] == 'l') {
+            batch_open = false;
+            status = start_in_place(&data[2], length - 2);
+        } else if (in_place_status != nullptr && data[0] == 'a') {
+            status = append_in_place(&data[2], length - 2);
+        } else if (in_place_status != nullptr && data[0] == 'f') {
+            status = finish_in_place();
+        } else if (data[0] == 'z') {
+            abort_in_place();
+            batch_open = false;
+            memset(kb_register_buffer, 0, sizeof(kb_register_buffer));
+            kb_register_buffer_offset = 0;
+            lz_decoder_init(&decoder);
+            decoder_status = LZ_OK;
+            status = decode_register(&data[2], length - 2);
+        } else if (data[0] == 'c') {
+            status = decode_register(&data[2], length - 2);
+        } else if (data[0] == 's') {
+            abort_in_place();
+            batch_open = false;
+            status = start_register(&data[2], length - 2);
+        } else if (data[0] == 'a') {
+            status = append_register(&data[2], length - 2);
+        } else {
+            status = finish_register();
+        }
+
+        send_raw_hid_ack(seq, status, length);
+        return;
+    }
+
+    debug("kb_sim: unknown instruction: 0x{:02x}", data[0]);
+}
@@ -0,0 +1,146 @@
+#pragma once
+
+#include <chrono>
+#include <deque>
+#include <random>
+#include <string>
+#include <vector>
+#include <cstdint>
+
+#include "transport.h"
+#include "reg.h"
+#include "lz.h"
+#include "fw/kb_registers.h"
+
+// Mirrors KB_REGISTER_BUFFER_MAX in the firmware described in README.md
+#define KB_SIM_BUFFER_MAX 8192
+// Largest report the simulated firmware handles, without the report id
+#define KB_SIM_REPORT_SIZE KB_LARGE_MESSAGE_SIZE
+
+struct kb_sim_options
+{
+    // Time from writing a report until its reply can be read
+    std::chrono::microseconds latency{1000};
+    // Each reply is delayed by an extra random amount in [-jitter, +jitter]
+    std::chrono::microseconds jitter{0};
+    // Percentage of reports, and separately of replies, lost on the way
+    int loss{0};
+    // Highest protocol version the simulated firmware understands
+    int protocol{2};
+    // KB_CAP_* bits advertised in the V reply
+    unsigned capabilities{KB_CAP_BATCH | KB_CAP_HASH | KB_CAP_LZ | KB_CAP_LIMITS | KB_CAP_LENGTH};
+    // Bytes of each report without the report id (RAW_EPSIZE), 32 or 64.
+    // 64 also advertises KB_CAP_REPORT64.
+    size_t report_size{KB_MESSAGE_SIZE};
+    // Bytes of the arena registers are stored in, at most KB_REGISTERS_ARENA_MAX
+    size_t heap{KB_REGISTERS_ARENA_MAX};
+};
+
+// An in-process keyboard running the raw_hid_receive handler from README.md,
+// with registers stored by the firmware module in src/fw/kb_registers.c.
+// Replies are queued and only become readable after the configured latency.
+class kb_sim : public transport
+{
+public:
+    explicit kb_sim(const kb_sim_options &options);
+    ~kb_sim() override;
+
+    int write(const unsigned char *data, size_t length) override;
+    int read_timeout(unsigned char *data, size_t length, int milliseconds) override;
+
+    std::wstring vendor() override;
+    std::wstring product() override;
+    std::wstring error() override;
+    size_t descriptor_message_size() override;
+    // The simulated keyboard is always the one configured, so it counts as
+    // having answered V before
+    int remembered_protocol() override;
+
+    // Contents of the register for key, or nullptr if it was never stored
+    const char *get_register(char key) const;
+
+private:
+    struct reply
+    {
+        std::chrono::steady_clock::time_point ready;
+        uint8_t data[KB_SIM_REPORT_SIZE];
+        size_t length;
+    };
+
+    // Whether the next report or reply is lost, see kb_sim_options::loss
+    bool lost();
+
+    void raw_hid_receive(uint8_t *data, uint8_t length);
+    void send_raw_hid_response(const char *msg, uint8_t length);
+    void send_raw_hid_ack(uint8_t seq, const char *msg, uint8_t length);
+    void raw_hid_send(uint8_t *data, uint8_t length);
+    void send_hashes(const uint8_t *data, uint8_t length);
+
+    // Handlers shared by the v1 and v2 messages
+    const char *start_register(const uint8_t *data, uint8_t length);
+    const char *append_register(const uint8_t *data, uint8_t length);
+    const char *finish_register();
+    const char *decode_register(const uint8_t *data, uint8_t length);
+    void commit_register(uint16_t keycode, int handle);
+
+    // Handlers of an upload written in place, from l to f
+    const char *start_in_place(const uint8_t *data, uint8_t length);
+    const char *append_in_place(const uint8_t *data, uint8_t length);
+    const char *finish_in_place();
+    void abort_in_place();
+
+    // Batch handlers
+    void begin_batch();
+    void stage_register();
+    void commit_batch(uint8_t seq, uint8_t length);
+
+    kb_sim_options options;
+    std::mt19937 rng;
+    std::deque<reply> replies;
+
+    std::vector<uint8_t> arena;
+    kb_registers registers;
+    // CRC-32 of each register without its zero, so H doesn't have to read it all
+    uint32_t hashes[KB_REGISTERS_KEYCODES] = {};
+    uint16_t kb_register_next_keycode{0};
+    // One spare byte keeps the terminating zero inside the buffer when it is full
+    char kb_register_buffer[KB_SIM_BUFFER_MAX + 1];
+    int kb_register_buffer_offset{0};
+
+    // Next sequence number expected from a v2 host
+    uint8_t next_seq{0};
+    // The ack or batch summary sent for the last sequenced report, repeated
+    // for duplicates so a lost summary can be recovered
+    uint8_t last_ack[KB_SIM_REPORT_SIZE] = {};
+    uint8_t last_ack_length{0};
+
+    // A register written in place between l and f: the status of the upload
+    // (nullptr when there is none), its key, the handle reserved for its length and a
+    // zero (-1 when there is none), and how much of it has arrived
+    const char *in_place_status{nullptr};
+    uint16_t in_place_keycode{0};
+    int in_place_handle{-1};
+    size_t in_place_size{0};
+    size_t in_place_offset{0};
+
+    // State of a compressed upload between z and f
+    lz_decoder decoder;
+    lz_status decoder_status{LZ_OK};
+
+    // A register received in a batch, stored when the batch is committed
+    struct staged_register
+    {
+        uint16_t keycode;
+        // Reserved in registers, -1 unless status is KB_STATUS_OK
+        int handle;
+        uint8_t status;
+    };
+
+    // Between B and C
+    bool batch_open{false};
+    // An r has started a record that isn't staged yet
+    bool batch_record_open{false};
+    uint16_t batch_keycode{0};
+    uint8_t batch_status{0};
+    std::vector<staged_register> batch;
+};
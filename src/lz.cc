@@ -0,0 +1,144 @@
+#include "lz.h"
+
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+using namespace std;
+
+static const int hash_bits{12};
+
+static uint32_t hash4(const char *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return (v * 2654435761u) >> (32 - hash_bits);
+}
+
+string lz_compress(const char *data, size_t size)
+{
+    string out;
+    out.reserve(size + size / LZ_MAX_LITERALS + 1);
+
+    // Most recent position of every hashed 4 byte sequence
+    vector<int64_t> head(1 << hash_bits, -1);
+
+    size_t literals{0};
+    auto flush_literals = [&](size_t end) {
+        while (literals < end) {
+            size_t n = min<size_t>(LZ_MAX_LITERALS, end - literals);
+            out += char(n - 1);
+            out.append(data + literals, n);
+            literals += n;
+        }
+    };
+
+    size_t i{0};
+    while (i + LZ_MIN_MATCH <= size) {
+        uint32_t h = hash4(data + i);
+        int64_t candidate = head[h];
+        head[h] = i;
+
+        if (candidate < 0 || i - candidate > LZ_WINDOW ||
+            memcmp(data + candidate, data + i, LZ_MIN_MATCH) != 0) {
+            ++i;
+            continue;
+        }
+
+        size_t len = LZ_MIN_MATCH;
+        while (i + len < size && len < LZ_MAX_MATCH && data[candidate + len] == data[i + len]) {
+            ++len;
+        }
+
+        flush_literals(i);
+        size_t offset = i - candidate - 1;
+        out += char(0x80 | (len - LZ_MIN_MATCH));
+        out += char(offset & 0xff);
+        out += char(offset >> 8);
+
+        // Keep later matches able to start inside this one
+        for (size_t k = i + 1; k < i + len && k + LZ_MIN_MATCH <= size; ++k) {
+            head[hash4(data + k)] = k;
+        }
+
+        i += len;
+        literals = i;
+    }
+
+    flush_literals(size);
+    return out;
+}
+
+enum
+{
+    LZ_TOKEN,
+    LZ_LITERALS,
+    LZ_OFFSET_LO,
+    LZ_OFFSET_HI,
+};
+
+void lz_decoder_init(lz_decoder *d)
+{
+    d->state = LZ_TOKEN;
+    d->count = 0;
+    d->offset = 0;
+}
+
+lz_status lz_decode(lz_decoder *d, const uint8_t *in, size_t size,
+                    uint8_t *out, size_t *out_len, size_t out_max)
+{
+    for (size_t i = 0; i < size; ++i) {
+        uint8_t b = in[i];
+
+        switch (d->state) {
+        case LZ_TOKEN:
+            if (b & 0x80) {
+                d->count = (b & 0x7f) + LZ_MIN_MATCH;
+                d->state = LZ_OFFSET_LO;
+            } else {
+                d->count = b + 1;
+                d->state = LZ_LITERALS;
+            }
+            break;
+
+        case LZ_LITERALS:
+            if (*out_len >= out_max) {
+                return LZ_OVERFLOW;
+            }
+            out[(*out_len)++] = b;
+            if (--d->count == 0) {
+                d->state = LZ_TOKEN;
+            }
+            break;
+
+        case LZ_OFFSET_LO:
+            d->offset = b;
+            d->state = LZ_OFFSET_HI;
+            break;
+
+        case LZ_OFFSET_HI: {
+            size_t distance = (d->offset | b << 8) + 1;
+            if (distance > *out_len) {
+                return LZ_BAD_DATA;
+            }
+            if (*out_len + d->count > out_max) {
+                return LZ_OVERFLOW;
+            }
+            // Byte by byte, since a match may overlap its own output
+            for (uint8_t n = 0; n < d->count; ++n) {
+                out[*out_len] = out[*out_len - distance];
+                ++*out_len;
+            }
+            d->state = LZ_TOKEN;
+            break;
+        }
+        }
+    }
+
+    return LZ_OK;
+}
+
+bool lz_decoder_done(const lz_decoder *d)
+{
+    return d->state == LZ_TOKEN;
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// A byte oriented LZ77 codec small enough to decode on a keyboard.
+//
+// The stream is a sequence of tokens:
+//   0nnnnnnn            n + 1 literal bytes follow (1 - 128)
+//   1nnnnnnn lo hi      copy n + LZ_MIN_MATCH bytes (4 - 131) starting
+//                       (hi << 8 | lo) + 1 bytes back in the output
+//
+// Matches never reach further back than LZ_WINDOW, the size of the
+// firmware's register buffer, so the decoder only needs its output.
+
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_MATCH (0x7f + LZ_MIN_MATCH)
+#define LZ_MAX_LITERALS 128
+#define LZ_WINDOW 8192
+
+std::string lz_compress(const char *data, size_t size);
+
+enum lz_status
+{
+    LZ_OK,
+    LZ_OVERFLOW,
+    LZ_BAD_DATA,
+};
+
+// Streaming decoder; the input may be split anywhere, even inside a token
+struct lz_decoder
+{
+    uint8_t state;
+    uint8_t count;
+    uint16_t offset;
+};
+
+void lz_decoder_init(lz_decoder *d);
+
+// Decodes size bytes of input, appending to out[*out_len] without going past out_max
+lz_status lz_decode(lz_decoder *d, const uint8_t *in, size_t size,
+                    uint8_t *out, size_t *out_len, size_t out_max);
+
+// True when the input so far ends on a token boundary
+bool lz_decoder_done(const lz_decoder *d);
@@ -0,0 +1,201 @@
+#include "metrics.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <mutex>
+
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include <spdlog/spdlog.h>
+
+using namespace std;
+using namespace std::chrono;
+using namespace spdlog;
+
+struct keyboard_metrics
+{
+    uint64_t uploads{0};
+    uint64_t failures{0};
+    uint64_t reports{0};
+    uint64_t bytes{0};
+    uint64_t timeouts{0};
+    uint64_t retransmits{0};
+    uint64_t overflows{0};
+    uint64_t out_of_memory{0};
+    rtt_histogram registers;
+    rtt_histogram ready;
+};
+
+static mutex metrics_mutex;
+static map<string, keyboard_metrics> keyboards;
+
+// Bucket bounds in microseconds.  Registers take milliseconds; getting a
+// keyboard ready includes the hotplug debounce and can take seconds.
+static const uint64_t register_bounds[] = {1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000, 1000000};
+static const uint64_t ready_bounds[] = {250000, 500000, 1000000, 2500000, 5000000, 10000000, 30000000};
+
+void metrics_record(const string &keyboard, const transport &dev, bool ok)
+{
+    lock_guard<mutex> lock(metrics_mutex);
+    keyboard_metrics &m = keyboards[keyboard];
+    m.uploads++;
+    if (!ok) {
+        m.failures++;
+    }
+    m.reports += dev.reports;
+    m.bytes += dev.bytes;
+    m.timeouts += dev.timeouts;
+    m.retransmits += dev.retransmits;
+    m.overflows += dev.overflows;
+    m.out_of_memory += dev.out_of_memory;
+    m.registers.merge(dev.registers);
+}
+
+void metrics_record_ready(const string &keyboard, steady_clock::duration elapsed)
+{
+    lock_guard<mutex> lock(metrics_mutex);
+    keyboards[keyboard].ready.record(elapsed);
+}
+
+static void counter(string &out, const char *name, const char *help,
+                    uint64_t keyboard_metrics::*field)
+{
+    out += fmt::format("# HELP {} {}\n# TYPE {} counter\n", name, help, name);
+    for (const auto &[keyboard, m] : keyboards) {
+        out += fmt::format("{}{{keyboard=\"{}\"}} {}\n", name, keyboard, m.*field);
+    }
+}
+
+template <size_t n>
+static void histogram(string &out, const char *name, const char *help,
+                      rtt_histogram keyboard_metrics::*field, const uint64_t (&bounds)[n])
+{
+    out += fmt::format("# HELP {} {}\n# TYPE {} histogram\n", name, help, name);
+    for (const auto &[keyboard, m] : keyboards) {
+        const rtt_histogram &h = m.*field;
+        for (uint64_t us : bounds) {
+            out += fmt::format("{}_bucket{{keyboard=\"{}\",le=\"{}\"}} {}\n", name, keyboard, us / 1e6, h.count_at_most(us));
+        }
+        out += fmt::format("{}_bucket{{keyboard=\"{}\",le=\"+Inf\"}} {}\n", name, keyboard, h.count);
+        out += fmt::format("{}_sum{{keyboard=\"{}\"}} {}\n", name, keyboard, h.total_us / 1e6);
+        out += fmt::format("{}_count{{keyboard=\"{}\"}} {}\n", name, keyboard, h.count);
+    }
+}
+
+string metrics_text()
+{
+    lock_guard<mutex> lock(metrics_mutex);
+
+    string out;
+    counter(out, "kb_detect_uploads_total", "Times a keyboard was configured", &keyboard_metrics::uploads);
+    counter(out, "kb_detect_upload_failures_total", "Configurations that did not store every register",
+            &keyboard_metrics::failures);
+    counter(out, "kb_detect_reports_total", "Reports written", &keyboard_metrics::reports);
+    counter(out, "kb_detect_bytes_total", "Bytes written, report ids included", &keyboard_metrics::bytes);
+    counter(out, "kb_detect_timeouts_total", "Replies the keyboard did not send in time", &keyboard_metrics::timeouts);
+    counter(out, "kb_detect_retransmits_total", "Reports written again after a timeout", &keyboard_metrics::retransmits);
+    counter(out, "kb_detect_overflows_total", "Overflow replies", &keyboard_metrics::overflows);
+    counter(out, "kb_detect_out_of_memory_total", "Out of Memory replies", &keyboard_metrics::out_of_memory);
+    histogram(out, "kb_detect_register_upload_seconds", "Time to store one register",
+              &keyboard_metrics::registers, register_bounds);
+    histogram(out, "kb_detect_ready_seconds", "Time from hotplug arrival until every register was loaded",
+              &keyboard_metrics::ready, ready_bounds);
+    return out;
+}
+
+bool metrics_write_textfile(const string &path)
+{
+    string text = metrics_text();
+    string tmp = fmt::format("{}.{}", path, getpid());
+
+    FILE *fp = fopen(tmp.c_str(), "w");
+    if (fp == nullptr) {
+        error("Unable to write metrics to {}: {}", tmp, strerror(errno));
+        return false;
+    }
+    fwrite(text.data(), 1, text.size(), fp);
+    if (fclose(fp) != 0 || rename(tmp.c_str(), path.c_str()) != 0) {
+        error("Unable to write metrics to {}: {}", path, strerror(errno));
+        unlink(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+metrics_server::metrics_server(const string &path) : path(path)
+{
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path)) {
+        error("Metrics socket path is too long: {}", path);
+        return;
+    }
+    strcpy(addr.sun_path, path.c_str());
+
+    // A socket file left by an earlier run would make bind fail
+    unlink(path.c_str());
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || ::bind(fd, (sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 8) < 0) {
+        error("Unable to listen on {}: {}", path, strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+            fd = -1;
+        }
+        return;
+    }
+    chmod(path.c_str(), 0600);
+
+    thread = std::thread(&metrics_server::run, this);
+}
+
+metrics_server::~metrics_server()
+{
+    if (fd < 0) {
+        return;
+    }
+    stop = true;
+    thread.join();
+    close(fd);
+    unlink(path.c_str());
+}
+
+void metrics_server::run()
+{
+    while (!stop) {
+        // Wake up regularly to notice stop
+        pollfd pfd{fd, POLLIN, 0};
+        if (poll(&pfd, 1, 500) <= 0) {
+            continue;
+        }
+
+        int client = accept(fd, nullptr, nullptr);
+        if (client < 0) {
+            continue;
+        }
+
+        string text = metrics_text();
+        const char *data = text.data();
+        size_t size = text.size();
+        while (size > 0) {
+            // A scraper that hangs up early raises SIGPIPE, which kb_detect ignores
+            ssize_t res = ::write(client, data, size);
+            if (res < 0 && errno == EINTR) {
+                continue;
+            }
+            if (res <= 0) {
+                break;
+            }
+            data += res;
+            size -= res;
+        }
+        close(client);
+    }
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <thread>
+
+#include "transport.h"
+
+// Counters and histograms of what kb_detect did to each keyboard, in the
+// Prometheus text format.  Keyboards are labelled by vendor:product id.
+
+// Adds the counters of dev, which was just configured, to keyboard's metrics
+void metrics_record(const std::string &keyboard, const transport &dev, bool ok);
+
+// Records the time from a hotplug arrival until every register was loaded
+void metrics_record_ready(const std::string &keyboard, std::chrono::steady_clock::duration elapsed);
+
+// Every metric in the Prometheus text exposition format
+std::string metrics_text();
+
+// Replaces path with metrics_text() in one rename, as node_exporter's
+// textfile collector expects
+bool metrics_write_textfile(const std::string &path);
+
+// Answers every connection to a Unix socket with metrics_text(), e.g. for
+// "socat - UNIX-CONNECT:path" or a scraper that speaks to sockets
+class metrics_server
+{
+public:
+    explicit metrics_server(const std::string &path);
+    ~metrics_server();
+
+private:
+    void run();
+
+    std::string path;
+    int fd{-1};
+    std::atomic<bool> stop{false};
+    std::thread thread;
+};
@@ -0,0 +1,196 @@
+#include "path_cache.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <spdlog/spdlog.h>
+
+#include "utf8util.h"
+
+using namespace std;
+using namespace spdlog;
+
+string get_runtime_dir()
+{
+    const char *runtime_dir = getenv("XDG_RUNTIME_DIR");
+    if (runtime_dir != nullptr && runtime_dir[0] != '\0') {
+        return runtime_dir;
+    }
+
+    // Anyone can create this name first, so only trust a directory, not a
+    // link, that belongs to this user and that nobody else can write to
+    string dir = fmt::format("/tmp/kb_reg-{}", getuid());
+    if (mkdir(dir.c_str(), 0700) != 0 && errno != EEXIST) {
+        debug("Unable to create {}: {}", dir, strerror(errno));
+        return "";
+    }
+    struct stat st;
+    if (lstat(dir.c_str(), &st) != 0 || !S_ISDIR(st.st_mode) || st.st_uid != getuid() || (st.st_mode & 077) != 0) {
+        debug("Not using {}, it isn't a directory private to this user", dir);
+        return "";
+    }
+    return dir;
+}
+
+string get_path_cache_path()
+{
+    string dir = get_runtime_dir();
+    return dir.empty() ? "" : dir + "/kb_reg.paths";
+}
+
+// One entry per line: vendor:product <tab> serial <tab> protocol <tab> path.
+// An empty serial is written as "-".
+static vector<cached_path> load()
+{
+    vector<cached_path> entries;
+
+    string path = get_path_cache_path();
+    if (path.empty()) {
+        return entries;
+    }
+    ifstream in(path);
+    string line;
+    while (getline(in, line)) {
+        istringstream fields(line);
+        string id, serial, protocol, path;
+        if (!getline(fields, id, '\t') || !getline(fields, serial, '\t') || !getline(fields, protocol, '\t') ||
+            !getline(fields, path) || path.empty()) {
+            continue;
+        }
+
+        unsigned vendor_id, product_id;
+        if (sscanf(id.c_str(), "%4x:%4x", &vendor_id, &product_id) != 2) {
+            continue;
+        }
+
+        entries.push_back(cached_path{uint16_t(vendor_id), uint16_t(product_id),
+                                      serial == "-" ? wstring() : u8dec(serial), path, atoi(protocol.c_str())});
+    }
+
+    return entries;
+}
+
+// Replaces the file in one rename so concurrent readers never see half of it.
+// mkstemp creates a new file rather than following whatever is at the name.
+static void save(const vector<cached_path> &entries)
+{
+    string path = get_path_cache_path();
+    if (path.empty()) {
+        return;
+    }
+    string tmp = path + ".XXXXXX";
+
+    int fd = mkstemp(tmp.data());
+    FILE *fp = fd < 0 ? nullptr : fdopen(fd, "w");
+    if (fp == nullptr) {
+        debug("Unable to write {}", tmp);
+        if (fd >= 0) {
+            close(fd);
+            unlink(tmp.c_str());
+        }
+        return;
+    }
+    for (const cached_path &entry : entries) {
+        string serial = entry.serial.empty() ? "-" : u8enc(entry.serial);
+        fprintf(fp, "%04x:%04x\t%s\t%d\t%s\n", entry.vendor_id, entry.product_id, serial.c_str(), entry.protocol,
+                entry.path.c_str());
+    }
+    if (fclose(fp) != 0 || rename(tmp.c_str(), path.c_str()) != 0) {
+        debug("Unable to write {}", path);
+        unlink(tmp.c_str());
+    }
+}
+
+static bool matches(const cached_path &entry, uint32_t id)
+{
+    uint16_t vendor_id = id >> 16;
+    uint16_t product_id = id & 0xffff;
+    return (vendor_id == 0 || vendor_id == entry.vendor_id) && (product_id == 0 || product_id == entry.product_id);
+}
+
+static bool same_keyboard(const cached_path &a, const cached_path &b)
+{
+    return a.vendor_id == b.vendor_id && a.product_id == b.product_id && a.serial == b.serial;
+}
+
+vector<cached_path> cached_raw_paths(const vector<uint32_t> &ids, const wstring &serial)
+{
+    vector<cached_path> found;
+    for (const cached_path &entry : load()) {
+        if (serial != L"" && serial != entry.serial) {
+            continue;
+        }
+        for (uint32_t id : ids) {
+            if (matches(entry, id)) {
+                found.push_back(entry);
+                break;
+            }
+        }
+    }
+    return found;
+}
+
+void cache_raw_paths(const vector<cached_path> &entries)
+{
+    vector<cached_path> added = entries;
+    vector<cached_path> kept;
+    for (const cached_path &old : load()) {
+        bool replaced = false;
+        for (cached_path &entry : added) {
+            // Keyboards without a serial number can't be told apart, so only the path identifies them
+            bool keyboard = !entry.serial.empty() && same_keyboard(old, entry);
+            if (old.path == entry.path || keyboard) {
+                // Still the same keyboard, so it still speaks the same protocol
+                if (entry.protocol == 0 && same_keyboard(old, entry)) {
+                    entry.protocol = old.protocol;
+                }
+                replaced = true;
+                break;
+            }
+        }
+        if (!replaced) {
+            kept.push_back(old);
+        }
+    }
+    kept.insert(kept.end(), added.begin(), added.end());
+    save(kept);
+}
+
+void forget_raw_path(const string &path)
+{
+    vector<cached_path> entries = load();
+    size_t size = entries.size();
+    erase_if(entries, [&path](const cached_path &entry) { return entry.path == path; });
+    if (entries.size() != size) {
+        save(entries);
+    }
+}
+
+int cached_protocol(const string &path)
+{
+    for (const cached_path &entry : load()) {
+        if (entry.path == path) {
+            return entry.protocol;
+        }
+    }
+    return 0;
+}
+
+void cache_protocol(const string &path, int protocol)
+{
+    vector<cached_path> entries = load();
+    for (cached_path &entry : entries) {
+        if (entry.path == path && entry.protocol != protocol) {
+            entry.protocol = protocol;
+            save(entries);
+            return;
+        }
+    }
+}
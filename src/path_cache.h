@@ -0,0 +1,42 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstdint>
+
+// Where the raw hid interface of each keyboard was last found, so opening a
+// keyboard that stayed attached doesn't need hid_enumerate.  Entries are only
+// hints: whoever opens a cached path must check it is still the same keyboard.
+struct cached_path
+{
+    uint16_t vendor_id;
+    uint16_t product_id;
+    std::wstring serial;
+    std::string path;
+    // Protocol the keyboard answered V with, 0 when it hasn't been asked
+    int protocol{0};
+};
+
+// $XDG_RUNTIME_DIR, or else the directory /tmp/kb_reg-<uid>, created if
+// needed.  Empty when that directory can't be made or isn't private to this
+// user, since another user could then swap its files for links.
+std::string get_runtime_dir();
+
+// kb_reg.paths in get_runtime_dir(), empty when there is none
+std::string get_path_cache_path();
+
+// Cached entries of keyboards in ids (vendor_id << 16 | product_id, where a
+// zero vendor or product id matches any) with this serial number when given
+std::vector<cached_path> cached_raw_paths(const std::vector<uint32_t> &ids, const std::wstring &serial = L"");
+
+// Adds entries, replacing any cached for the same path or the same keyboard
+void cache_raw_paths(const std::vector<cached_path> &entries);
+
+// Drops the entry for a path that no longer leads to its keyboard
+void forget_raw_path(const std::string &path);
+
+// Protocol cached for the keyboard at path, 0 when unknown
+int cached_protocol(const std::string &path);
+
+// Remembers the protocol of the keyboard at path, if path is cached
+void cache_protocol(const std::string &path, int protocol);
@@ -0,0 +1,70 @@
+#include "plan.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+
+#include <spdlog/spdlog.h>
+
+using namespace std;
+using namespace spdlog;
+
+size_t register_text(const string &value)
+{
+    return strnlen(value.data(), value.size());
+}
+
+size_t max_register_text(const keyboard_limits &limits)
+{
+    size_t max = SIZE_MAX;
+    if (limits.max_register > 0) {
+        max = limits.max_register;
+    }
+    if (limits.free_memory > 0) {
+        max = min(max, limits.free_memory - 1);
+    }
+    return max;
+}
+
+upload_plan plan_uploads(const keyboard_limits &limits, const vector<pair<string, string>> &registers,
+                         bool truncate)
+{
+    upload_plan plan;
+    size_t max = max_register_text(limits);
+    // Bytes the firmware allocates for the registers: each text and its zero
+    size_t needed{0};
+
+    for (const auto &[key, value] : registers) {
+        size_t text = register_text(value);
+        if (text <= max) {
+            plan.registers.emplace_back(key, value);
+            needed += text + 1;
+            continue;
+        }
+
+        plan.adjusted = true;
+        if (!truncate) {
+            warn("Not storing {}, it has {} bytes and the keyboard can store at most {}", key, text, max);
+            plan.rejected.push_back(key);
+            continue;
+        }
+
+        warn("Truncating {} from {} to the {} bytes the keyboard can store", key, text, max);
+        plan.registers.emplace_back(key, value.substr(0, max));
+        plan.truncated.push_back(key);
+        needed += max + 1;
+    }
+
+    // Registers replaced free their old text, so running out is only likely,
+    // and the order still matters when it happens
+    if (limits.free_memory > 0 && needed > limits.free_memory) {
+        debug("Registers need {} bytes, keyboard has {} free, storing the smallest first",
+              needed, limits.free_memory);
+        stable_sort(plan.registers.begin(), plan.registers.end(), [](const auto &a, const auto &b) {
+            return register_text(a.second) < register_text(b.second);
+        });
+        plan.adjusted = true;
+    }
+
+    return plan;
+}
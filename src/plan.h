@@ -0,0 +1,42 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "transport.h"
+
+// Decides what to upload before any data moves, from the limits a keyboard
+// with KB_CAP_LIMITS reported (transport::limits).  Uploads that can never
+// fit are left out instead of failing with "Overflow" or "Out of Memory"
+// after the whole register was sent.
+
+// Bytes of a register's text: firmware stops storing at the first zero
+size_t register_text(const std::string &value);
+
+// Longest text a single register can hold on a keyboard with these limits.
+// Firmware allocates the text and its zero, so free memory bounds it too.
+// SIZE_MAX when the keyboard didn't say.
+size_t max_register_text(const keyboard_limits &limits);
+
+struct upload_plan
+{
+    // (key, value) of every register to upload, in the order to upload them
+    std::vector<std::pair<std::string, std::string>> registers;
+    // Keys of registers left out because they can never fit
+    std::vector<std::string> rejected;
+    // Keys of registers cut down to max_register_text
+    std::vector<std::string> truncated;
+    // True when registers differs from what was planned in any way
+    bool adjusted{false};
+};
+
+// Fits registers to limits.  A register longer than max_register_text is cut
+// down when truncate is set and left out otherwise.  When the registers need
+// more memory than the keyboard has free they are ordered smallest first, so
+// one large register can't use up the room of many small ones; otherwise
+// their order is kept.  Logs every register it changes.
+upload_plan plan_uploads(const keyboard_limits &limits,
+                         const std::vector<std::pair<std::string, std::string>> &registers,
+                         bool truncate = false);
@@ -0,0 +1,154 @@
+#include "preflight.h"
+
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define PREFLIGHT_X86 1
+#endif
+
+bool typeable(unsigned char c)
+{
+    // Printable ASCII and DEL, plus backspace, tab, enter and escape
+    return (c >= 0x20 && c <= 0x7f) || c == '\b' || c == '\t' || c == '\n' || c == 0x1b;
+}
+
+// Handles the bytes in [start, end) one at a time
+static void preflight_scalar(const char *data, size_t start, size_t end, char *out,
+                             size_t &written, preflight_result &result)
+{
+    for (size_t i = start; i < end; ++i) {
+        unsigned char c = data[i];
+        if (!typeable(c) && result.invalid > i) {
+            result.invalid = i;
+        }
+        if (c == '\\') {
+            ++result.backslashes;
+            if (out) {
+                out[written++] = '\\';
+            }
+        }
+        if (out) {
+            out[written++] = c;
+        }
+    }
+}
+
+#ifdef PREFLIGHT_X86
+
+__attribute__((target("sse2")))
+static size_t preflight_sse2(const char *data, size_t size, char *out, size_t &written, preflight_result &result)
+{
+    const __m128i space_minus_one = _mm_set1_epi8(0x1f);
+    const __m128i backspace = _mm_set1_epi8('\b');
+    const __m128i tab = _mm_set1_epi8('\t');
+    const __m128i enter = _mm_set1_epi8('\n');
+    const __m128i escape = _mm_set1_epi8(0x1b);
+    const __m128i backslash = _mm_set1_epi8('\\');
+
+    size_t i = 0;
+    for (; i + 16 <= size; i += 16) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i));
+
+        // Signed compare, so bytes >= 0x80 are negative and fail it
+        __m128i ok = _mm_cmpgt_epi8(v, space_minus_one);
+        ok = _mm_or_si128(ok, _mm_cmpeq_epi8(v, backspace));
+        ok = _mm_or_si128(ok, _mm_cmpeq_epi8(v, tab));
+        ok = _mm_or_si128(ok, _mm_cmpeq_epi8(v, enter));
+        ok = _mm_or_si128(ok, _mm_cmpeq_epi8(v, escape));
+
+        unsigned bad = ~_mm_movemask_epi8(ok) & 0xffff;
+        if (bad && result.invalid > i) {
+            result.invalid = i + __builtin_ctz(bad);
+        }
+
+        unsigned slashes = _mm_movemask_epi8(_mm_cmpeq_epi8(v, backslash));
+        if (slashes == 0) {
+            if (out) {
+                _mm_storeu_si128(reinterpret_cast<__m128i *>(out + written), v);
+                written += 16;
+            }
+        } else {
+            result.backslashes += __builtin_popcount(slashes);
+            if (out) {
+                for (size_t k = i; k < i + 16; ++k) {
+                    if (data[k] == '\\') {
+                        out[written++] = '\\';
+                    }
+                    out[written++] = data[k];
+                }
+            }
+        }
+    }
+    return i;
+}
+
+__attribute__((target("avx2")))
+static size_t preflight_avx2(const char *data, size_t size, char *out, size_t &written, preflight_result &result)
+{
+    const __m256i space_minus_one = _mm256_set1_epi8(0x1f);
+    const __m256i backspace = _mm256_set1_epi8('\b');
+    const __m256i tab = _mm256_set1_epi8('\t');
+    const __m256i enter = _mm256_set1_epi8('\n');
+    const __m256i escape = _mm256_set1_epi8(0x1b);
+    const __m256i backslash = _mm256_set1_epi8('\\');
+
+    size_t i = 0;
+    for (; i + 32 <= size; i += 32) {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + i));
+
+        // Signed compare, so bytes >= 0x80 are negative and fail it
+        __m256i ok = _mm256_cmpgt_epi8(v, space_minus_one);
+        ok = _mm256_or_si256(ok, _mm256_cmpeq_epi8(v, backspace));
+        ok = _mm256_or_si256(ok, _mm256_cmpeq_epi8(v, tab));
+        ok = _mm256_or_si256(ok, _mm256_cmpeq_epi8(v, enter));
+        ok = _mm256_or_si256(ok, _mm256_cmpeq_epi8(v, escape));
+
+        unsigned bad = ~(unsigned) _mm256_movemask_epi8(ok);
+        if (bad && result.invalid > i) {
+            result.invalid = i + __builtin_ctz(bad);
+        }
+
+        unsigned slashes = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, backslash));
+        if (slashes == 0) {
+            if (out) {
+                _mm256_storeu_si256(reinterpret_cast<__m256i *>(out + written), v);
+                written += 32;
+            }
+        } else {
+            result.backslashes += __builtin_popcount(slashes);
+            if (out) {
+                for (size_t k = i; k < i + 32; ++k) {
+                    if (data[k] == '\\') {
+                        out[written++] = '\\';
+                    }
+                    out[written++] = data[k];
+                }
+            }
+        }
+    }
+    return i;
+}
+
+#endif
+
+preflight_result preflight(const char *data, size_t size, char *out)
+{
+    preflight_result result{size, 0};
+    size_t written{0};
+    size_t done{0};
+
+#ifdef PREFLIGHT_X86
+    static const bool has_avx2 = __builtin_cpu_supports("avx2");
+    static const bool has_sse2 = __builtin_cpu_supports("sse2");
+
+    if (has_avx2) {
+        done = preflight_avx2(data, size, out, written, result);
+    } else if (has_sse2) {
+        done = preflight_sse2(data, size, out, written, result);
+    }
+#endif
+
+    preflight_scalar(data, done, size, out, written, result);
+    return result;
+}
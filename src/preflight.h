@@ -0,0 +1,23 @@
+#pragma once
+
+#include <cstddef>
+
+// Firmware types registers with SEND_STRING, which looks every byte up in
+// ascii_to_keycode_lut.  Bytes without a key there type nothing (or garbage)
+// and a zero ends the register early, so uploads are checked first.
+
+struct preflight_result
+{
+    // Offset of the first byte the keyboard can't type, or the size when it can type them all
+    size_t invalid;
+    // Number of \ characters
+    size_t backslashes;
+};
+
+// True if ascii_to_keycode_lut has a key for c
+bool typeable(unsigned char c);
+
+// Checks every byte of data in one pass, using SSE2 or AVX2 when available.
+// When out isn't null data is also copied there with every \ doubled; out
+// needs room for 2 * size bytes and receives size + backslashes of them.
+preflight_result preflight(const char *data, size_t size, char *out = nullptr);
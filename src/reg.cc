@@ -1,4 +1,3 @@
-#include <sstream>
 #include <cstdio>
 #include <wchar.h>
 #include <string.h>
@@ -6,9 +5,13 @@
 #include <cstring>
 
 #include <cstdlib>
+#include <algorithm>
 #include <chrono>
 
-#include <unistd.h>
+#include <array>
+#include <vector>
+#include <mutex>
+#include <span>
 
 #include <spdlog/spdlog.h>
 #include <spdlog/cfg/env.h>
@@ -19,6 +22,11 @@
 #include <fmt/xchar.h>
 
 #include "utf8util.h"
+#include "crc32.h"
+#include "lz.h"
+#include "path_cache.h"
+#include "trace.h"
+#include "reg.h"
 
 // Fallback/example
 #ifndef HID_API_MAKE_VERSION
@@ -37,8 +45,21 @@ using namespace std::chrono;
 using namespace std::chrono_literals; // c++14 min
 using namespace spdlog;
 
+// Every call uses its own buffers so keyboards can be configured from several threads
 static const size_t buf_size{256};
-static unsigned char buf[buf_size];
+
+// hid_enumerate and hid_open_path aren't thread safe on every platform
+static mutex hid_mutex;
+
+// Calls f with the report_layout for message_size, so each encoder is
+// compiled once for each report size with its payload sizes as constants
+template <typename F>
+static auto with_layout(size_t message_size, F f) {
+    if (message_size == KB_LARGE_MESSAGE_SIZE) {
+        return f(report_layout<KB_LARGE_MESSAGE_SIZE>());
+    }
+    return f(report_layout<KB_MESSAGE_SIZE>());
+}
 
 void hid_version_check()
 {
@@ -47,9 +68,12 @@ void hid_version_check()
     }
 }
 
-hid_device_info* find_raw(hid_device_info *devs, int usage_id, int usage_page)
+hid_device_info* find_raw(hid_device_info *devs, int usage_id, int usage_page, const wstring &serial)
 {
     for (hid_device_info *i = devs; i != nullptr; i=i->next) {
+        if (serial != L"" && (i->serial_number == nullptr || serial != i->serial_number)) {
+            continue;
+        }
         if (i->usage == usage_id) {
             if (i->usage_page == usage_page) {
                 //info("Found raw at {}",i->path);
@@ -61,132 +85,1056 @@ hid_device_info* find_raw(hid_device_info *devs, int usage_id, int usage_page)
     return nullptr;
 }
 
-int read(hid_device *dev, unsigned char *buf, size_t amt, duration<float, std::milli> timeout)
+// Blocks until amt bytes have been read or the deadline passes.
+// Returns amt on success, -1 on error and -2 on timeout.
+int read(transport *dev, unsigned char *buf, size_t amt, duration<float, std::milli> timeout)
 {
-    steady_clock::time_point start = high_resolution_clock::now();
+    steady_clock::time_point deadline = steady_clock::now() + duration_cast<steady_clock::duration>(timeout);
 
     size_t read{0};
 
     while (true) {
-        int res = hid_read(dev, buf, amt - read);
+        steady_clock::duration remaining = deadline - steady_clock::now();
+        if (remaining <= 0s) {
+            debug("hid_read() timeout");
+            return -2;
+        }
+
+        // hid_read_timeout only has millisecond resolution, so round up
+        int ms = duration_cast<milliseconds>(remaining + 999us).count();
+
+        int res = dev->read_timeout(buf + read, amt - read, ms);
         if (res < 0) {
-            error("Unable to read(): {}", u8enc(hid_error(dev)));
-            break;
+            error("Unable to read(): {}", u8enc(dev->error()));
+            return -1;
         }
 
         read += res;
         if (read == amt) {
             return read;
         }
+    }
+}
 
-        steady_clock::time_point now = high_resolution_clock::now();
+// hid_get_device_info appeared in hidapi 0.13.  Without it a cached path
+// can't be checked, so the cache is bypassed.
+#if HID_API_VERSION >= HID_API_MAKE_VERSION(0, 13, 0)
+#define HAVE_HID_GET_DEVICE_INFO 1
+#endif
 
-        if ((now - start) > timeout) {
-            error("hid_read() timeout");
-            break;
-        }
+// Opens a path from the path cache if it still leads to the raw interface of
+// the same keyboard.  Must be called with hid_mutex held.
+static transport *open_cached(const cached_path &entry)
+{
+#ifdef HAVE_HID_GET_DEVICE_INFO
+    hid_device *dev = hid_open_path(entry.path.c_str());
+    if (!dev) {
+        return nullptr;
+    }
 
-        usleep(200);
+    hid_device_info *info = hid_get_device_info(dev);
+    if (info == nullptr || info->vendor_id != entry.vendor_id || info->product_id != entry.product_id ||
+        info->usage != RAW_USAGE_ID || info->usage_page != RAW_USAGE_PAGE ||
+        entry.serial != (info->serial_number ? info->serial_number : L"")) {
+        hid_close(dev);
+        return nullptr;
     }
-    return -2;
+
+    remember_device_strings(entry.path, info);
+    return new hid_transport(dev, entry.path);
+#else
+    (void) entry;
+    return nullptr;
+#endif
 }
 
+static cached_path cache_entry(const hid_device_info *info)
+{
+    return cached_path{info->vendor_id, info->product_id,
+                       info->serial_number ? wstring(info->serial_number) : wstring(), info->path};
+}
 
-hid_device *open_raw(int vendor_id, int product_id)
+transport *open_raw(int vendor_id, int product_id, const wstring &serial)
 {
-    hid_device *raw_dev = nullptr;
+    return open_raw(vector<uint32_t>{uint32_t(vendor_id) << 16 | uint32_t(product_id)}, serial);
+}
 
-    struct hid_device_info *devs = hid_enumerate(vendor_id, product_id);
-    hid_device_info* raw_dev_info = find_raw(devs, RAW_USAGE_ID, RAW_USAGE_PAGE);
+transport *open_raw(const vector<uint32_t> &ids, const wstring &serial)
+{
+    lock_guard<mutex> lock(hid_mutex);
+
+    for (const cached_path &entry : cached_raw_paths(ids, serial)) {
+        trace_scope span("open cached");
+        if (transport *raw_dev = open_cached(entry)) {
+            debug("Opened cached path {}", entry.path);
+            return raw_dev;
+        }
+        forget_raw_path(entry.path);
+    }
+
+    transport *raw_dev = nullptr;
+    bool found = false;
+
+    for (uint32_t id : ids) {
+        steady_clock::time_point start = steady_clock::now();
+        struct hid_device_info *devs = hid_enumerate(id >> 16, id & 0xffff);
+        trace_span("enumerate", start, steady_clock::now());
+        hid_device_info* raw_dev_info = find_raw(devs, RAW_USAGE_ID, RAW_USAGE_PAGE, serial);
+
+        if (raw_dev_info != nullptr) {
+            found = true;
+            remember_device_strings(raw_dev_info->path, raw_dev_info);
 
-    if (raw_dev_info != nullptr) {
-        // Open before we free devs
-        raw_dev = hid_open_path(raw_dev_info->path);
+            // Open before we free devs
+            start = steady_clock::now();
+            hid_device *dev = hid_open_path(raw_dev_info->path);
+            trace_span("open", start, steady_clock::now());
 
-        if (!raw_dev) {
-            error("Unable to open raw device");
+            if (dev) {
+                raw_dev = new hid_transport(dev, raw_dev_info->path);
+                cache_raw_paths({cache_entry(raw_dev_info)});
+            } else {
+                error("Unable to open raw device");
+            }
         }
-    } else {
+
+        hid_free_enumeration(devs);
+        if (found) {
+            break;
+        }
+    }
+
+    if (!found) {
         error("Unable to find raw device");
     }
+    return raw_dev;
+}
 
+vector<string> find_raw_paths(int vendor_id, int product_id, const wstring &serial)
+{
+    lock_guard<mutex> lock(hid_mutex);
+
+    vector<string> paths;
+    vector<cached_path> entries;
+
+    steady_clock::time_point start = steady_clock::now();
+    struct hid_device_info *devs = hid_enumerate(vendor_id, product_id);
+    trace_span("enumerate", start, steady_clock::now());
+    for (hid_device_info *i = find_raw(devs, RAW_USAGE_ID, RAW_USAGE_PAGE, serial); i != nullptr;
+         i = find_raw(i->next, RAW_USAGE_ID, RAW_USAGE_PAGE, serial)) {
+        remember_device_strings(i->path, i);
+        paths.push_back(i->path);
+        entries.push_back(cache_entry(i));
+    }
     hid_free_enumeration(devs);
-    return raw_dev;
+
+    // Lets the next open_raw skip enumeration
+    if (!entries.empty()) {
+        cache_raw_paths(entries);
+    }
+
+    return paths;
 }
 
-// checks for return string from keyboard and prints errors
-void check_ok(hid_device *dev) {
-    memset(buf,0,sizeof(buf));
+transport *open_raw_path(const string &path)
+{
+    lock_guard<mutex> lock(hid_mutex);
+    trace_scope span("open");
+
+    hid_device *dev = hid_open_path(path.c_str());
+    if (!dev) {
+        error("Unable to open raw device {}", path);
+        forget_device_strings(path);
+        return nullptr;
+    }
+    return new hid_transport(dev, path);
+}
+
+// Writes one report and prints any error
+static int write_report(transport *dev, const unsigned char *report) {
+    int res = dev->write(report, dev->report_size());
+    if (res < 0) {
+        printf("Unable to write(): %ls\n", dev->error().c_str());
+    } else {
+        dev->reports++;
+        dev->bytes += res;
+    }
+    return res;
+}
+
+// Counts the replies that say the keyboard ran out of space
+static void count_error(transport *dev, const char *reply) {
+    if (strcmp(reply, "Overflow") == 0) {
+        dev->overflows++;
+    } else if (strcmp(reply, "Out of Memory") == 0) {
+        dev->out_of_memory++;
+    }
+}
+
+// Records a report with message id that was written at sent and just answered.
+// Only a report written once tells the round trip time, see rto_estimator.
+static void record_round_trip(transport *dev, unsigned char id, steady_clock::time_point sent, bool retransmitted = false) {
+    steady_clock::time_point now = steady_clock::now();
+    if (!retransmitted) {
+        dev->rtt.record(now - sent);
+        dev->rto.sample(now - sent);
+    }
+    trace_report(id, sent, now);
+}
+
+// Reads and discards replies still in flight after an upload was aborted or a
+// report was answered twice
+static void drain(transport *dev) {
+    unsigned char ack[32];
+    while (read(dev, ack, 32, dev->rto.timeout()) > 0) {
+        debug("Discarding reply {:c} {}", (char)ack[0], ack[1]);
+    }
+}
+
+// Writes a report the keyboard may safely process more than once and reads its
+// 32 byte reply into buf.  A reply that doesn't come within the retransmission
+// timeout gets the report written again, up to KB_MAX_ATTEMPTS times in all.
+// Returns what read() returned for the last attempt.
+static int transact(transport *dev, const unsigned char *report, unsigned char *buf) {
+    for (int attempt = 1; ; ++attempt) {
+        steady_clock::time_point sent = steady_clock::now();
+        if (write_report(dev, report) < 0) {
+            return -1;
+        }
+
+        memset(buf,0,32);
+        int res = read(dev, buf, 32, dev->rto.timeout());
+        if (res > 0) {
+            record_round_trip(dev, report[1], sent, attempt > 1);
+            if (attempt > 1) {
+                // The reply to the first write may still be on its way
+                drain(dev);
+            }
+            return res;
+        }
+        if (res == -1) {
+            return res;
+        }
+
+        dev->timeouts++;
+        dev->rto.backoff();
+        if (attempt == KB_MAX_ATTEMPTS) {
+            return res;
+        }
+        debug("No reply to {:c} in time, writing it again", (char)report[1]);
+        dev->retransmits++;
+    }
+}
+
+// How a stop-and-wait report went
+enum class reply_status { ok, error, timeout };
+
+// Sends one report and waits for "OK", printing what went wrong otherwise.
+// A is not sent again on timeout: appending twice would corrupt the register.
+// Its reply is waited for as long as transact would wait for the others.
+static reply_status exchange(transport *dev, const unsigned char *report) {
+    if (report[1] != 'A') {
+        debug("Sending {:c}", (char)report[1]);
+    }
+
+    unsigned char buf[buf_size];
+    int res;
+    if (report[1] == 'A') {
+        steady_clock::time_point sent = steady_clock::now();
+        if (write_report(dev, report) < 0) {
+            dev->failures++;
+            return reply_status::timeout;
+        }
+        for (int attempt = 1; ; ++attempt) {
+            memset(buf,0,sizeof(buf));
+            res = read(dev, buf, 32, dev->rto.timeout());
+            if (res > 0) {
+                // Written once, so the round trip is a fair sample however late
+                record_round_trip(dev, 'A', sent);
+                break;
+            }
+            if (res == -1) {
+                break;
+            }
+            dev->timeouts++;
+            dev->rto.backoff();
+            if (attempt == KB_MAX_ATTEMPTS) {
+                break;
+            }
+            debug("No reply to A in time, waiting longer");
+        }
+    } else {
+        res = transact(dev, report, buf);
+    }
 
-    int res = read(dev, buf, 32, 5ms);
     if (res == -1) {
         printf("Error reading from usb device\n");
+        dev->failures++;
+        return reply_status::timeout;
     }
     if (res == -2) {
         printf("Timeout reading from usb device\n");
+        dev->failures++;
+        return reply_status::timeout;
     }
-    if (res > 0) {
-        if (strcmp((char*)buf, "OK") != 0) {
-            printf("Error from keyboard: %s\n", buf);
-        }
+    if (strcmp((char*)buf, "OK") != 0) {
+        printf("Error from keyboard: %s\n", buf);
+        count_error(dev, (char*)buf);
+        return reply_status::error;
     }
+    return reply_status::ok;
+}
+
+// Sends one report and waits for "OK"
+static bool send_report(transport *dev, const unsigned char *report) {
+    return exchange(dev, report) == reply_status::ok;
 }
 
-void set_key(hid_device *dev, const string &key) {
+bool set_key(transport *dev, const string &key) {
+    unsigned char buf[buf_size];
     memset(buf,0,sizeof(buf));
 
     buf[0] = 0x0;
     buf[1] = 'K';
     buf[2] = key.at(0);
 
-    debug("Sending K");
-    int res = hid_write(dev, buf, 33);
-    if (res < 0) {
-        printf("Unable to write(): %ls\n", hid_error(dev));
-    }
-
-    check_ok(dev);
+    return send_report(dev, buf);
 }
 
-void store_data(hid_device *dev, const string &data) {
+int query_protocol(transport *dev) {
+    unsigned char buf[buf_size];
     memset(buf,0,sizeof(buf));
 
-    std::istringstream iss(data);
-
     buf[0] = 0x0;
-    buf[1] = 'S';
+    buf[1] = 'V';
 
-    debug("Sending S");
-    iss.read(reinterpret_cast<char *>(&buf[2]), 31);
-    int res = hid_write(dev, buf, 33);
-    if (res < 0) {
-        printf("Unable to write(): %ls\n", hid_error(dev));
+    // V itself always goes out as a KB_REPORT_SIZE report
+    dev->message_size = KB_MESSAGE_SIZE;
+    dev->limits = keyboard_limits();
+
+    // Firmware that predates V silently ignores it, so V is written once and
+    // a timeout means v1; waiting out retries would delay every upload to it.
+    // Only a keyboard that answered V before gets V written again, as its
+    // silence means the V or the reply was lost.  That isn't congestion
+    // either, so the backoff is undone when it never answers.
+    int remembered = dev->remembered_protocol();
+    debug("Sending V");
+    int res;
+    if (remembered >= KB_PROTOCOL_V2) {
+        rto_estimator rto = dev->rto;
+        unsigned char query[KB_MAX_REPORT_SIZE];
+        memcpy(query, buf, sizeof(query));
+        res = transact(dev, query, buf);
+        if (res <= 0) {
+            dev->rto = rto;
+        }
+    } else {
+        steady_clock::time_point sent = steady_clock::now();
+        res = write_report(dev, buf);
+        if (res >= 0) {
+            memset(buf,0,sizeof(buf));
+            res = read(dev, buf, 32, dev->rto.timeout());
+            if (res > 0) {
+                record_round_trip(dev, 'V', sent);
+            }
+        }
+    }
+
+    int protocol = KB_PROTOCOL_V1;
+    if (res > 0 && buf[0] == 'V' && buf[1] >= KB_PROTOCOL_V2) {
+        protocol = KB_PROTOCOL_V2;
+        dev->capabilities = buf[2];
+        debug("Keyboard speaks protocol v{} with capabilities 0x{:02x}", buf[1], buf[2]);
+
+        if (dev->capabilities & KB_CAP_LIMITS) {
+            dev->limits.report_size = buf[3];
+            dev->limits.max_register = buf[4] | buf[5] << 8;
+            dev->limits.free_memory = buf[6] | buf[7] << 8 | buf[8] << 16 | (uint32_t)buf[9] << 24;
+            debug("Keyboard has {} byte reports, {} byte registers and {} bytes free",
+                  dev->limits.report_size, dev->limits.max_register, dev->limits.free_memory);
+        }
+
+        if ((dev->capabilities & KB_CAP_REPORT64) || dev->limits.report_size >= KB_LARGE_MESSAGE_SIZE) {
+            // Trust the firmware when the descriptor can't be read, but not
+            // when the descriptor says the endpoint is smaller
+            size_t declared = dev->descriptor_message_size();
+            if (declared == 0 || declared >= KB_LARGE_MESSAGE_SIZE) {
+                dev->message_size = KB_LARGE_MESSAGE_SIZE;
+            } else {
+                warn("Keyboard claims 64 byte reports but its descriptor declares {}", declared);
+            }
+        }
+    } else {
+        dev->capabilities = 0;
+        debug("Keyboard did not answer V, using protocol v1");
+    }
+
+    if (protocol != remembered) {
+        dev->remember_protocol(protocol);
+    }
+    return protocol;
+}
+
+uint32_t register_hash(const string &value, unsigned capabilities) {
+    if (capabilities & KB_CAP_LENGTH) {
+        return crc32(value.data(), value.size());
     }
-    check_ok(dev);
+    return crc32(value.data(), strnlen(value.data(), value.size()));
+}
+
+bool query_hashes(transport *dev, const vector<string> &keys, vector<optional<uint32_t>> &hashes) {
+    unsigned char buf[buf_size];
+    hashes.assign(keys.size(), nullopt);
+
+    for (size_t first = 0; first < keys.size(); first += KB_HASH_MAX_KEYS) {
+        size_t n = min<size_t>(KB_HASH_MAX_KEYS, keys.size() - first);
 
-    while (!iss.eof()) {
         memset(buf,0,sizeof(buf));
         buf[0] = 0x0;
-        buf[1] = 'A';
+        buf[1] = 'H';
+        buf[2] = n;
+        for (size_t i = 0; i < n; ++i) {
+            buf[3 + i] = keys[first + i].at(0);
+        }
 
-        iss.read(reinterpret_cast<char *>(&buf[2]), 31);
-        int res = hid_write(dev, buf, 33);
-        if (res < 0) {
-            printf("Unable to write(): %ls\n", hid_error(dev));
+        debug("Sending H");
+
+        // The reply is 'H', the number of keys, a bit per key that has a
+        // register, then a little endian hash per key
+        unsigned char query[KB_MAX_REPORT_SIZE];
+        memcpy(query, buf, sizeof(query));
+        int res = transact(dev, query, buf);
+        if (res == -1) {
+            printf("Error reading from usb device\n");
+            return false;
+        }
+        if (res == -2) {
+            printf("Timeout reading from usb device\n");
+            return false;
+        }
+        if (buf[0] != 'H' || buf[1] != n) {
+            printf("Error from keyboard: %s\n", buf);
+            drain(dev);
+            return false;
+        }
+        for (size_t i = 0; i < n; ++i) {
+            if (buf[2] & (1 << i)) {
+                const unsigned char *h = &buf[3 + 4 * i];
+                hashes[first + i] = h[0] | h[1] << 8 | h[2] << 16 | (uint32_t)h[3] << 24;
+            }
         }
-        check_ok(dev);
     }
 
-    memset(buf,0,sizeof(buf));
+    return true;
+}
 
-    buf[0] = 0x0;
-    buf[1] = 'F';
+// Appends a zeroed report of report_size bytes with the given message id and returns it
+static unsigned char *append_report(vector<unsigned char> &out, char id, size_t report_size) {
+    out.resize(out.size() + report_size, 0);
+    unsigned char *report = &out[out.size() - report_size];
+    report[1] = id;
+    return report;
+}
+
+void encode_key(vector<unsigned char> &out, const string &key, size_t message_size) {
+    append_report(out, 'K', message_size + 1)[2] = key.at(0);
+}
+
+template <size_t MessageSize>
+data_encoder<MessageSize>::data_encoder(span<const byte> data, int protocol, bool compressed, optional<char> key)
+    : data(data), protocol(compressed || key ? KB_PROTOCOL_V2 : protocol), compressed(compressed),
+      key(compressed ? nullopt : key)
+{
+}
+
+template <size_t MessageSize>
+size_t data_encoder<MessageSize>::first_payload_size() const {
+    return key ? layout::keyed_payload_size : payload_size();
+}
+
+template <size_t MessageSize>
+size_t data_encoder<MessageSize>::payload_size() const {
+    if (compressed) {
+        return layout::lz_payload_size;
+    }
+    return protocol < KB_PROTOCOL_V2 ? layout::v1_payload_size : layout::v2_payload_size;
+}
+
+template <size_t MessageSize>
+size_t data_encoder<MessageSize>::count() const {
+    size_t rest = data.size() - min(data.size(), first_payload_size());
+    size_t payload_reports = 1 + (rest + payload_size() - 1) / payload_size();
+    return payload_reports + 1;
+}
+
+template <size_t MessageSize>
+bool data_encoder<MessageSize>::next(unsigned char *report) {
+    if (done) {
+        return false;
+    }
+
+    memset(report, 0, layout::report_size);
+    size_t len = min(n == 0 ? first_payload_size() : payload_size(), data.size() - offset);
+
+    // Even empty data gets its S before F stores the register
+    if (n > 0 && len == 0) {
+        if (protocol < KB_PROTOCOL_V2) {
+            report[1] = 'F';
+        } else {
+            report[1] = 'f';
+            report[2] = n & 0xff;
+        }
+        done = true;
+        return true;
+    }
+
+    if (protocol < KB_PROTOCOL_V2) {
+        // S carries the first message, A the rest
+        report[1] = n == 0 ? 'S' : 'A';
+        memcpy(&report[2], data.data() + offset, len);
+    } else if (key && n == 0) {
+        // The keyboard allocates the register up front and copies every
+        // byte, zeros included, straight into it
+        report[1] = 'l';
+        report[2] = n & 0xff;
+        report[3] = *key;
+        report[4] = data.size() & 0xff;
+        report[5] = data.size() >> 8;
+        memcpy(&report[6], data.data() + offset, len);
+    } else if (!compressed) {
+        // Sequence numbers restart at 0 with every 's', so the same data always
+        // encodes to the same reports
+        report[1] = n == 0 ? 's' : 'a';
+        report[2] = n & 0xff;
+        memcpy(&report[3], data.data() + offset, len);
+    } else {
+        // Unlike text, compressed data may contain zeros, so each report says
+        // how much of it is payload
+        report[1] = n == 0 ? 'z' : 'c';
+        report[2] = n & 0xff;
+        report[3] = len;
+        memcpy(&report[4], data.data() + offset, len);
+    }
+
+    offset += len;
+    ++n;
+    return true;
+}
 
-    debug("Sending F");
-    res = hid_write(dev, buf, 33);
+template class data_encoder<KB_MESSAGE_SIZE>;
+template class data_encoder<KB_LARGE_MESSAGE_SIZE>;
+
+template <size_t MessageSize>
+static void append_encoded(vector<unsigned char> &out, data_encoder<MessageSize> &encoder) {
+    unsigned char report[MessageSize + 1];
+    while (encoder.next(report)) {
+        out.insert(out.end(), report, report + sizeof(report));
+    }
+}
+
+// The keyboard keeps text up to the first zero, and compressed data can't
+// tell it where that is
+static string compress(const string &data) {
+    return lz_compress(data.data(), strnlen(data.data(), data.size()));
+}
+
+void encode_data(vector<unsigned char> &out, const string &data, int protocol, size_t message_size) {
+    with_layout(message_size, [&](auto layout) {
+        data_encoder<decltype(layout)::message_size> encoder(as_bytes(span(data)), protocol);
+        append_encoded(out, encoder);
+    });
+}
+
+void encode_keyed(vector<unsigned char> &out, const string &key, const string &data, size_t message_size) {
+    with_layout(message_size, [&](auto layout) {
+        data_encoder<decltype(layout)::message_size> encoder(as_bytes(span(data)), KB_PROTOCOL_V2, false, key.at(0));
+        append_encoded(out, encoder);
+    });
+}
+
+void encode_compressed(vector<unsigned char> &out, const string &data, size_t message_size) {
+    string packed = compress(data);
+    with_layout(message_size, [&](auto layout) {
+        data_encoder<decltype(layout)::message_size> encoder(as_bytes(span(packed)), KB_PROTOCOL_V2, true);
+        append_encoded(out, encoder);
+    });
+}
+
+template <typename layout>
+static void encode_batch(vector<unsigned char> &out, const vector<pair<string, string>> &registers) {
+    for (size_t first = 0; first < registers.size(); first += KB_BATCH_MAX_RECORDS) {
+        size_t last = min(first + KB_BATCH_MAX_RECORDS, registers.size());
+
+        // Like 's', 'B' restarts the sequence numbers
+        size_t n{0};
+        append_report(out, 'B', layout::report_size)[2] = n++ & 0xff;
+
+        for (size_t i = first; i < last; ++i) {
+            const string &data = registers[i].second;
+
+            // 'r' starts a record for its key, 'a' continues it
+            unsigned char *report = append_report(out, 'r', layout::report_size);
+            report[2] = n++ & 0xff;
+            report[3] = registers[i].first.at(0);
+            size_t offset = min(layout::record_payload_size, data.size());
+            memcpy(&report[4], data.data(), offset);
+
+            while (offset < data.size()) {
+                report = append_report(out, 'a', layout::report_size);
+                report[2] = n++ & 0xff;
+                size_t len = min(layout::v2_payload_size, data.size() - offset);
+                memcpy(&report[3], data.data() + offset, len);
+                offset += len;
+            }
+        }
+
+        append_report(out, 'C', layout::report_size)[2] = n & 0xff;
+    }
+}
+
+void encode_batch(vector<unsigned char> &out, const vector<pair<string, string>> &registers, size_t message_size) {
+    with_layout(message_size, [&](auto layout) {
+        encode_batch<decltype(layout)>(out, registers);
+    });
+}
+
+static const char *status_message(uint8_t status) {
+    switch (status) {
+    case KB_STATUS_OK:
+        return "OK";
+    case KB_STATUS_OVERFLOW:
+        return "Overflow";
+    case KB_STATUS_OUT_OF_MEMORY:
+        return "Out of Memory";
+    }
+    return "Unknown status";
+}
+
+// Prints every register of a batch that the summary reply reports as not stored.
+// The summary is '$', sequence number, record count, then one status per record.
+static bool check_summary(transport *dev, const unsigned char *frames, size_t total, const unsigned char *summary) {
+    bool ok{true};
+    size_t record{0};
+
+    for (size_t i = 0; i < total; ++i) {
+        const unsigned char *frame = frames + i * dev->report_size();
+        if (frame[1] != 'r') {
+            continue;
+        }
+
+        if (record >= summary[2] || record >= KB_BATCH_MAX_RECORDS) {
+            printf("No status from keyboard for register %c\n", frame[3]);
+            ok = false;
+        } else if (summary[3 + record] != KB_STATUS_OK) {
+            printf("Error from keyboard for register %c: %s\n", frame[3], status_message(summary[3 + record]));
+            count_error(dev, status_message(summary[3 + record]));
+            ok = false;
+        }
+        ++record;
+    }
+
+    return ok;
+}
+
+frame_window::frame_window(transport *dev, int window)
+    : dev(dev), window(clamp(window, 1, KB_MAX_WINDOW)), base(dev->next_seq)
+{
+}
+
+bool frame_window::send(const unsigned char *frame) {
+    while (!failed && sent - acked >= window) {
+        wait_ack();
+    }
+    if (failed) {
+        return false;
+    }
+
+    size_t slot = sent % KB_MAX_WINDOW;
+    memcpy(in_flight[slot].data(), frame, dev->report_size());
+    in_flight[slot][2] = (base + sent) & 0xff;
+    retransmitted[slot] = false;
+    sent_at[slot] = steady_clock::now();
+    if (write_report(dev, in_flight[slot].data()) < 0) {
+        drain(dev);
+        failed = true;
+        gave_up = true;
+        dev->failures++;
+        return false;
+    }
+    ++sent;
+    dev->next_seq = (base + sent) & 0xff;
+    return true;
+}
+
+void frame_window::retransmit() {
+    debug("No ack for sequence {} in time, writing {} frames again", (base + acked) & 0xff, sent - acked);
+
+    for (size_t i = acked; i < sent; ++i) {
+        size_t slot = i % KB_MAX_WINDOW;
+        retransmitted[slot] = true;
+        sent_at[slot] = steady_clock::now();
+        if (write_report(dev, in_flight[slot].data()) < 0) {
+            drain(dev);
+            failed = true;
+            gave_up = true;
+            dev->failures++;
+            return;
+        }
+        dev->retransmits++;
+    }
+    ++attempts;
+    ++attempts_total;
+}
+
+bool frame_window::flush() {
+    while (!failed && acked < sent) {
+        wait_ack();
+    }
+    // Frames written again make the keyboard repeat acks, which the next
+    // upload must not take for its own
+    if (!failed && attempts_total > 0) {
+        drain(dev);
+    }
+    return !failed;
+}
+
+void frame_window::wait_ack() {
+    unsigned char ack[32];
+
+    memset(ack,0,sizeof(ack));
+    int res = read(dev, ack, 32, dev->rto.timeout());
+    if (res == -2) {
+        dev->timeouts++;
+        dev->rto.backoff();
+        if (attempts >= KB_MAX_ATTEMPTS) {
+            printf("Timeout reading from usb device\n");
+            failed = true;
+            gave_up = true;
+            dev->failures++;
+            return;
+        }
+        retransmit();
+        return;
+    }
     if (res < 0) {
-        printf("Unable to write(): %ls\n", hid_error(dev));
+        printf("Error reading from usb device\n");
+        failed = true;
+        gave_up = true;
+        dev->failures++;
+        return;
+    }
+    if (ack[0] != '#' && ack[0] != '$') {
+        printf("Error from keyboard: %s\n", ack);
+        count_error(dev, (char*)ack);
+        drain(dev);
+        failed = true;
+        return;
+    }
+
+    // Map the 8-bit sequence number back onto the frames in flight
+    size_t n = acked;
+    while (n < sent && ((base + n) & 0xff) != ack[1]) {
+        ++n;
+    }
+    if (n == sent) {
+        // Every frame written again after the keyboard processed it repeats the
+        // last ack, which may still be for the previous upload
+        if (((base + acked - 1) & 0xff) == ack[1]) {
+            debug("Ignoring repeated ack for sequence {}", ack[1]);
+        } else {
+            warn("Ignoring ack for unexpected sequence {}", ack[1]);
+        }
+        return;
+    }
+
+    if (ack[0] == '$') {
+        if (n + 1 < sent) {
+            printf("Summary from keyboard before the end of the batch\n");
+            drain(dev);
+            failed = true;
+            return;
+        }
+        memcpy(summary, ack, sizeof(summary));
+    } else if (strcmp((char*)&ack[2], "OK") != 0) {
+        printf("Error from keyboard: %s\n", &ack[2]);
+        count_error(dev, (char*)&ack[2]);
+        drain(dev);
+        failed = true;
+        return;
+    }
+
+    steady_clock::time_point now = steady_clock::now();
+    if (!retransmitted[n % KB_MAX_WINDOW]) {
+        dev->rtt.record(now - sent_at[n % KB_MAX_WINDOW]);
+        dev->rto.sample(now - sent_at[n % KB_MAX_WINDOW]);
+    }
+    // One ack covers every frame up to n, each ends here in the trace
+    if (trace_enabled()) {
+        for (size_t i = acked; i <= n; ++i) {
+            trace_report(in_flight[i % KB_MAX_WINDOW][1], sent_at[i % KB_MAX_WINDOW], now);
+        }
+    }
+    acked = n + 1;
+    attempts = 1;
+}
+
+// Sends the frames of one v2 upload or batch through a frame_window.
+// A batch's C is answered by a summary instead of an ack.
+static reply_status send_window(transport *dev, const unsigned char *frames, size_t total, int window) {
+    debug("Sending {} frames with window {}", total, window);
+
+    frame_window w(dev, window);
+    for (size_t i = 0; i < total; ++i) {
+        if (!w.send(frames + i * dev->report_size())) {
+            return w.timed_out() ? reply_status::timeout : reply_status::error;
+        }
+    }
+    if (!w.flush()) {
+        return w.timed_out() ? reply_status::timeout : reply_status::error;
+    }
+
+    if (frames[1] != 'B') {
+        return reply_status::ok;
+    }
+    if (w.summary[0] != '$') {
+        printf("No summary from keyboard for the batch\n");
+        return reply_status::error;
+    }
+    return check_summary(dev, frames, total, w.summary) ? reply_status::ok : reply_status::error;
+}
+
+static bool is_sequenced(const unsigned char *report) {
+    return report[1] == 's' || report[1] == 'l' || report[1] == 'a' || report[1] == 'f' ||
+           report[1] == 'z' || report[1] == 'c' ||
+           report[1] == 'B' || report[1] == 'r' || report[1] == 'C';
+}
+
+bool send_reports(transport *dev, const unsigned char *reports, size_t count, int window) {
+    bool ok{true};
+    size_t report_size = dev->report_size();
+    // When the S of the v1 register being sent was written
+    steady_clock::time_point register_start;
+
+    for (size_t i = 0; i < count; ) {
+        const unsigned char *report = reports + i * report_size;
+
+        if (!is_sequenced(report)) {
+            if (report[1] == 'S') {
+                register_start = steady_clock::now();
+            }
+            reply_status status = exchange(dev, report);
+            ++i;
+            if (status == reply_status::timeout) {
+                // Every report after this would time out as well
+                return false;
+            }
+            if (status == reply_status::error) {
+                ok = false;
+                // The rest of a register the keyboard refused is pointless
+                if (report[1] == 'S' || report[1] == 'A') {
+                    while (i < count && reports[i * report_size + 1] != 'F') {
+                        ++i;
+                    }
+                    i = min(i + 1, count);
+                }
+                continue;
+            }
+            if (report[1] == 'F') {
+                dev->registers.record(steady_clock::now() - register_start);
+            }
+            continue;
+        }
+
+        // A v2 upload runs from its 's', 'l' or 'z' up to and including its 'f', a batch
+        // from its 'B' up to and including its 'C'
+        char last = report[1] == 'B' ? 'C' : 'f';
+        size_t end = i + 1;
+        while (end < count && reports[end * report_size + 1] != last) {
+            ++end;
+        }
+        end = min(end + 1, count);
+
+        steady_clock::time_point start = steady_clock::now();
+        reply_status status = send_window(dev, report, end - i, window);
+        if (status == reply_status::timeout) {
+            return false;
+        }
+        if (status == reply_status::ok) {
+            steady_clock::duration elapsed = steady_clock::now() - start;
+            for (size_t j = i; j < end; ++j) {
+                // A v2 upload stores one register, a batch one per record
+                if (reports[j * report_size + 1] == 'f' || reports[j * report_size + 1] == 'r') {
+                    dev->registers.record(elapsed);
+                }
+            }
+        } else {
+            ok = false;
+        }
+        i = end;
+    }
+
+    return ok;
+}
+
+bool store_data(transport *dev, const string &data) {
+    return store_data(dev, data, KB_PROTOCOL_V1, 1);
+}
+
+bool store_register(transport *dev, const string &key, const string &data, int protocol, int window) {
+    if (protocol < KB_PROTOCOL_V2 || !(dev->capabilities & KB_CAP_LENGTH) || data.size() > 0xffff) {
+        return (key == "" || set_key(dev, key)) && store_data(dev, data, protocol, window);
+    }
+
+    // Every byte is stored, not just the text before the first zero
+    if (dev->limits.max_register > 0 && data.size() > dev->limits.max_register) {
+        printf("Data is %zu bytes, registers on this keyboard hold %zu\n", data.size(), dev->limits.max_register);
+        return false;
+    }
+
+    return with_layout(dev->message_size, [&](auto layout) {
+        data_encoder<decltype(layout)::message_size> keyed(as_bytes(span(data)), protocol, false,
+                                                           key == "" ? '\0' : key.at(0));
+
+        // Compressed uploads need a K first and stop at the first zero, so
+        // they only win for text that compresses by more than that report
+        if ((dev->capabilities & KB_CAP_LZ) && strnlen(data.data(), data.size()) == data.size()) {
+            string packed = compress(data);
+            data_encoder<decltype(layout)::message_size> compressed(as_bytes(span(packed)), protocol, true);
+            if (compressed.count() + 1 < keyed.count()) {
+                debug("Compressed {} reports to {}", keyed.count(), compressed.count());
+                return (key == "" || set_key(dev, key)) && send_encoded(dev, compressed, window);
+            }
+        }
+
+        return send_encoded(dev, keyed, window);
+    });
+}
+
+bool store_data(transport *dev, const string &data, int protocol, int window) {
+    // Only the register size: free memory changes with every upload
+    size_t text = strnlen(data.data(), data.size());
+    if (dev->limits.max_register > 0 && text > dev->limits.max_register) {
+        printf("Data is %zu bytes, registers on this keyboard hold %zu\n", text, dev->limits.max_register);
+        return false;
+    }
+
+    return with_layout(dev->message_size, [&](auto layout) {
+        data_encoder<decltype(layout)::message_size> plain(as_bytes(span(data)), protocol);
+
+        if (protocol >= KB_PROTOCOL_V2 && (dev->capabilities & KB_CAP_LZ)) {
+            string packed = compress(data);
+            data_encoder<decltype(layout)::message_size> compressed(as_bytes(span(packed)), protocol, true);
+            if (compressed.count() < plain.count()) {
+                debug("Compressed {} reports to {}", plain.count(), compressed.count());
+                return send_encoded(dev, compressed, window);
+            }
+        }
+
+        return send_encoded(dev, plain, window);
+    });
+}
+
+template <size_t MessageSize>
+bool send_encoded(transport *dev, data_encoder<MessageSize> &encoder, int window) {
+    unsigned char report[MessageSize + 1];
+    steady_clock::time_point start = steady_clock::now();
+
+    if (!encoder.sequenced()) {
+        while (encoder.next(report)) {
+            if (!send_report(dev, report)) {
+                return false;
+            }
+        }
+        dev->registers.record(steady_clock::now() - start);
+        return true;
+    }
+
+    frame_window frames(dev, window);
+    while (encoder.next(report)) {
+        if (!frames.send(report)) {
+            return false;
+        }
+    }
+    if (!frames.flush()) {
+        return false;
+    }
+    dev->registers.record(steady_clock::now() - start);
+    return true;
+}
+
+template bool send_encoded(transport *, data_encoder<KB_MESSAGE_SIZE> &, int);
+template bool send_encoded(transport *, data_encoder<KB_LARGE_MESSAGE_SIZE> &, int);
+
+data_stream::data_stream(transport *dev, int protocol, int window, bool truncate)
+    : dev(dev), protocol(protocol), report_size(dev->report_size()), frames(dev, window),
+      max_size(dev->limits.max_register > 0 ? dev->limits.max_register : SIZE_MAX), truncate(truncate)
+{
+    memset(report,0,sizeof(report));
+}
+
+// Same as data_encoder's, but for the report size the keyboard was found to take
+size_t data_stream::payload_size() const {
+    return report_size - (protocol < KB_PROTOCOL_V2 ? 2 : 3);
+}
+
+bool data_stream::write(const char *data, size_t size) {
+    if (ok && size > max_size - written) {
+        if (!truncate) {
+            printf("Data is longer than the %zu bytes registers on this keyboard hold\n", max_size);
+            ok = false;
+            return false;
+        }
+        if (!truncated) {
+            warn("Truncating data to the {} bytes registers on this keyboard hold", max_size);
+            truncated = true;
+        }
+        size = max_size - written;
+    }
+    written += size;
+
+    while (ok && size > 0) {
+        size_t len = min(payload_size() - payload, size);
+        memcpy(&report[report_size - payload_size() + payload], data, len);
+        payload += len;
+        data += len;
+        size -= len;
+
+        if (payload == payload_size()) {
+            send_report();
+        }
+    }
+    return ok;
+}
+
+bool data_stream::finish() {
+    // Even empty data needs its S
+    if (payload > 0 || n == 0) {
+        send_report();
+    }
+
+    if (protocol < KB_PROTOCOL_V2) {
+        report[1] = 'F';
+        ok = ok && ::send_report(dev, report);
+        return ok;
+    }
+
+    report[1] = 'f';
+    report[2] = n & 0xff;
+    ok = ok && frames.send(report) && frames.flush();
+    return ok;
+}
+
+void data_stream::send_report() {
+    if (protocol < KB_PROTOCOL_V2) {
+        report[1] = n == 0 ? 'S' : 'A';
+        ok = ok && ::send_report(dev, report);
+    } else {
+        report[1] = n == 0 ? 's' : 'a';
+        report[2] = n & 0xff;
+        ok = ok && frames.send(report);
     }
 
-    check_ok(dev);
+    ++n;
+    payload = 0;
+    memset(report,0,sizeof(report));
 }
@@ -2,16 +2,288 @@
 
 #include <hidapi.h>
 #include <string>
+#include <vector>
+#include <array>
+#include <chrono>
+#include <span>
+#include <cstddef>
+#include <optional>
+#include <cstdint>
+
+#include "transport.h"
+
+// Stop-and-wait uploads understood by every keyboard
+#define KB_PROTOCOL_V1 1
+// Sequence-numbered frames with several reports in flight
+#define KB_PROTOCOL_V2 2
+
+// Bytes of a message after the report id.  Keyboards with KB_CAP_REPORT64
+// take KB_LARGE_MESSAGE_SIZE, see query_protocol.  Replies are read as
+// KB_MESSAGE_SIZE bytes either way; what follows is padding.
+#define KB_MESSAGE_SIZE 32
+#define KB_LARGE_MESSAGE_SIZE 64
+
+// Report id followed by a message
+#define KB_REPORT_SIZE (KB_MESSAGE_SIZE + 1)
+#define KB_MAX_REPORT_SIZE (KB_LARGE_MESSAGE_SIZE + 1)
+
+#define KB_DEFAULT_WINDOW 8
+#define KB_MAX_WINDOW 128
+
+// Times a report is written before its reply is given up on.  The wait for
+// each reply is the transport's rto_estimator timeout, doubled every time.
+#define KB_MAX_ATTEMPTS 4
+
+// Capability bits a v2 keyboard lists in the third byte of its V reply
+// Stores many registers in one B..C transaction
+#define KB_CAP_BATCH 0x01
+// Answers H with the hash of registers it holds
+#define KB_CAP_HASH 0x02
+// Decodes uploads compressed with lz_compress (lz.h)
+#define KB_CAP_LZ 0x04
+// Takes 64 byte messages (RAW_EPSIZE 64)
+#define KB_CAP_REPORT64 0x08
+// Follows the capabilities with its report size, the size of its registers
+// (16 bits) and its free memory (32 bits), little endian, see keyboard_limits
+#define KB_CAP_LIMITS 0x10
+// Takes 'l' uploads, which name their key and length up front
+#define KB_CAP_LENGTH 0x20
+
+// Registers per batch; the summary reply has one status byte for each
+#define KB_BATCH_MAX_RECORDS 29
+
+// Keys per H query; the reply has a 4 byte hash for each
+#define KB_HASH_MAX_KEYS 7
+
+// Per-register status codes in a batch summary
+#define KB_STATUS_OK 0
+#define KB_STATUS_OVERFLOW 1
+#define KB_STATUS_OUT_OF_MEMORY 2
 
 void hid_version_check();
 
-hid_device *open_raw(int vendor_id, int product_id);
+// Opens the raw hid interface of the keyboard.  Delete the transport to close it.
+// When serial is given only the keyboard with that serial number is considered.
+// Tries the path it was found at last time (path_cache.h) before enumerating.
+transport *open_raw(int vendor_id, int product_id, const std::wstring &serial = L"");
+
+// Opens the first keyboard found among ids (vendor_id << 16 | product_id, where
+// zero matches any), enumerating only those ids when no cached path is valid
+transport *open_raw(const std::vector<uint32_t> &ids, const std::wstring &serial = L"");
+
+// Paths of the raw hid interfaces of every attached keyboard with this vendor
+// and product id, and serial number when given
+std::vector<std::string> find_raw_paths(int vendor_id, int product_id, const std::wstring &serial = L"");
+
+// Opens a raw hid interface found by find_raw_paths.  Delete the transport to close it.
+transport *open_raw_path(const std::string &path);
+
+// Switch current key in keyboard.  Returns false if the keyboard did not reply "OK".
+bool set_key(transport *dev, const std::string &key);
+
+// sends value to they keyboard. Will be associated with current (or last set) key.
+// Returns false if any report failed or was not acknowledged with "OK".
+bool store_data(transport *dev, const std::string &value);
+
+// Asks the keyboard which protocol it speaks and sets dev->capabilities and
+// dev->limits.  Sets dev->message_size to 64 when the keyboard takes 64 byte
+// reports and its report descriptor, if it can be read, agrees.
+// Returns KB_PROTOCOL_V1 when it doesn't answer.
+int query_protocol(transport *dev);
+
+// Stores value in key's register, or in the register K selected last when key
+// is "".  A v2 keyboard with KB_CAP_LENGTH gets one 'l' upload that names the
+// key itself, which saves the K round trip and keeps any zeros in value.
+// Others get set_key then store_data.
+bool store_register(transport *dev, const std::string &key, const std::string &value, int protocol, int window);
+
+// sends value using the given protocol, keeping up to window reports in flight for v2.
+// Compresses value when the keyboard has KB_CAP_LZ and that saves reports.
+// Sends nothing and returns false when value is longer than dev->limits allow.
+bool store_data(transport *dev, const std::string &value, int protocol, int window);
+
+// The hash a keyboard with these capabilities reports for a register that
+// store_register filled with value.  With KB_CAP_LENGTH every byte is stored;
+// otherwise the firmware stops at the first zero byte, so only the text before
+// it counts.
+uint32_t register_hash(const std::string &value, unsigned capabilities);
+
+// Asks a keyboard with KB_CAP_HASH for the hash of each key's register.
+// hashes gets one entry per key, empty if the keyboard has no such register.
+// Returns false if the keyboard didn't answer.
+bool query_hashes(transport *dev, const std::vector<std::string> &keys,
+                  std::vector<std::optional<uint32_t>> &hashes);
+
+// The encoders below write reports of message_size + 1 bytes.  message_size
+// is KB_MESSAGE_SIZE or KB_LARGE_MESSAGE_SIZE, see transport::message_size.
+
+// Appends the K report that selects key to out
+void encode_key(std::vector<unsigned char> &out, const std::string &key,
+                size_t message_size = KB_MESSAGE_SIZE);
+
+// Appends the reports that upload value with the given protocol to out
+void encode_data(std::vector<unsigned char> &out, const std::string &value, int protocol,
+                 size_t message_size = KB_MESSAGE_SIZE);
+
+// Appends the 'l' upload that stores value in key's register.  Needs KB_CAP_LENGTH.
+void encode_keyed(std::vector<unsigned char> &out, const std::string &key, const std::string &value,
+                  size_t message_size = KB_MESSAGE_SIZE);
+
+// Appends the v2 reports that upload value compressed with lz_compress.  Needs KB_CAP_LZ.
+void encode_compressed(std::vector<unsigned char> &out, const std::string &value,
+                       size_t message_size = KB_MESSAGE_SIZE);
+
+// Appends batches that store every (key, value) pair in registers, with
+// KB_BATCH_MAX_RECORDS registers per batch.  Needs KB_CAP_BATCH.
+void encode_batch(std::vector<unsigned char> &out,
+                  const std::vector<std::pair<std::string, std::string>> &registers,
+                  size_t message_size = KB_MESSAGE_SIZE);
+
+// Sends count reports made by encode_key/encode_data for dev->message_size.
+// Runs of v2 frames and batches are windowed, everything else is stop-and-wait.
+bool send_reports(transport *dev, const unsigned char *reports, size_t count, int window);
+
+// Keeps up to window sequenced frames in flight.  Acks are cumulative: an ack
+// for sequence n acknowledges every frame up to and including n.  Frames are
+// numbered from 0 by their encoder; their sequence numbers are rewritten to
+// continue from the transport's next_seq.  When no ack arrives in time every
+// frame in flight is written again (go-back-N).
+class frame_window
+{
+public:
+    frame_window(transport *dev, int window);
+
+    // Sends one frame, first waiting for acks while the window is full.
+    // Once anything failed every call returns false.
+    bool send(const unsigned char *frame);
+
+    // Waits until every frame sent so far has been acknowledged
+    bool flush();
+
+    // True when it failed because the keyboard stopped answering or the
+    // device failed, rather than the keyboard answering with an error
+    bool timed_out() const { return gave_up; }
+
+    // The batch summary ('$' ...) that acknowledged the last frame, if any
+    unsigned char summary[32] = {};
+
+private:
+    void wait_ack();
+    void retransmit();
+
+    transport *dev;
+    size_t window;
+    // Sequence number of the first frame
+    uint8_t base;
+    size_t sent{0};
+    size_t acked{0};
+    // Times the oldest frame in flight has been written, and how often
+    // frames were written again in all
+    int attempts{1};
+    int attempts_total{0};
+    bool failed{false};
+    bool gave_up{false};
+    std::array<std::chrono::steady_clock::time_point, KB_MAX_WINDOW> sent_at;
+    // Copies of the frames in flight, to write them again
+    std::array<std::array<unsigned char, KB_MAX_REPORT_SIZE>, KB_MAX_WINDOW> in_flight;
+    std::array<bool, KB_MAX_WINDOW> retransmitted;
+};
+
+// Uploads a value that arrives in pieces, e.g. from a pipe.  Each report is
+// sent as soon as its payload is complete, so reading overlaps with sending.
+class data_stream
+{
+public:
+    // Data beyond dev->limits.max_register is dropped when truncate is set and
+    // fails the upload otherwise
+    data_stream(transport *dev, int protocol, int window, bool truncate = false);
+
+    // Returns false once any report failed or the data got too long
+    bool write(const char *data, size_t size);
+
+    // Sends what is left and stores the register
+    bool finish();
+
+private:
+    size_t payload_size() const;
+    void send_report();
+
+    transport *dev;
+    int protocol;
+    // dev->report_size() when the stream was created
+    size_t report_size;
+    frame_window frames;
+    unsigned char report[KB_MAX_REPORT_SIZE];
+    // Bytes of payload in report
+    size_t payload{0};
+    // Reports sent so far
+    size_t n{0};
+    bool ok{true};
+    // Bytes written so far, and how many a register holds (SIZE_MAX when unknown)
+    size_t written{0};
+    size_t max_size;
+    bool truncate;
+    bool truncated{false};
+};
+
+// Payload of each kind of report in a MessageSize byte message
+template <size_t MessageSize>
+struct report_layout
+{
+    static constexpr size_t message_size = MessageSize;
+    static constexpr size_t report_size = MessageSize + 1;
+    // v1 reports are id then payload
+    static constexpr size_t v1_payload_size = MessageSize - 1;
+    // v2 reports are id, sequence number, then payload
+    static constexpr size_t v2_payload_size = MessageSize - 2;
+    // Batch records are id, sequence number, key, then payload
+    static constexpr size_t record_payload_size = MessageSize - 3;
+    // Compressed reports are id, sequence number, length, then payload
+    static constexpr size_t lz_payload_size = MessageSize - 3;
+    // 'l' is id, sequence number, key, 16 bit length, then payload
+    static constexpr size_t keyed_payload_size = MessageSize - 5;
+};
+
+// Splits a value into the reports that upload it, one report at a time and
+// without allocating, so the value can be sent straight from where it is.
+// Instantiated for KB_MESSAGE_SIZE and KB_LARGE_MESSAGE_SIZE.
+template <size_t MessageSize>
+class data_encoder
+{
+public:
+    using layout = report_layout<MessageSize>;
+
+    // compressed values come from lz_compress and are always sent with protocol v2.
+    // With a key the upload starts with 'l' for that key ('\0' for the register
+    // K selected), also with protocol v2.  Needs KB_CAP_LENGTH.
+    data_encoder(std::span<const std::byte> data, int protocol, bool compressed = false,
+                 std::optional<char> key = std::nullopt);
+
+    // Writes the next layout::report_size byte report.  Returns false when all were written.
+    bool next(unsigned char *report);
+
+    // Number of reports next() writes in total
+    size_t count() const;
+
+    // True when the reports go through a frame_window rather than stop-and-wait
+    bool sequenced() const { return protocol >= KB_PROTOCOL_V2; }
 
-std::wstring get_vendor(hid_device *hid_dev);
-std::wstring get_product(hid_device *hid_dev);
+private:
+    // Payload of the first report, and of each one after it
+    size_t first_payload_size() const;
+    size_t payload_size() const;
 
-// Switch current key in keyboard
-void set_key(hid_device *dev, const std::string &key);
+    std::span<const std::byte> data;
+    int protocol;
+    bool compressed;
+    std::optional<char> key;
+    size_t offset{0};
+    // Reports written so far
+    size_t n{0};
+    bool done{false};
+};
 
-// sends value to they keyboard. Will be associated with current (or last set) key
-void store_data(hid_device *dev, const std::string &value);
+// Sends every report of encoder, keeping up to window in flight when they are
+// sequenced.  MessageSize must be dev->message_size.
+template <size_t MessageSize>
+bool send_encoded(transport *dev, data_encoder<MessageSize> &encoder, int window);
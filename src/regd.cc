@@ -0,0 +1,143 @@
+#include "regd.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <spdlog/spdlog.h>
+
+#include "path_cache.h"
+
+using namespace std;
+using namespace spdlog;
+
+string get_socket_path()
+{
+    string dir = get_runtime_dir();
+    return dir.empty() ? "" : dir + "/kb_regd.sock";
+}
+
+static bool write_all(int fd, const char *data, size_t size)
+{
+    while (size > 0) {
+        ssize_t res = ::write(fd, data, size);
+        if (res < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        data += res;
+        size -= res;
+    }
+    return true;
+}
+
+static bool read_all(int fd, char *data, size_t size)
+{
+    while (size > 0) {
+        ssize_t res = ::read(fd, data, size);
+        if (res < 0 && errno == EINTR) {
+            continue;
+        }
+        if (res <= 0) {
+            return false;
+        }
+        data += res;
+        size -= res;
+    }
+    return true;
+}
+
+// Reads up to and excluding '\n'.  Lines are short, so one byte at a time is fine.
+static bool read_line(int fd, string &line)
+{
+    line.clear();
+    char c;
+    while (read_all(fd, &c, 1)) {
+        if (c == '\n') {
+            return true;
+        }
+        if (line.size() >= 256) {
+            return false;
+        }
+        line += c;
+    }
+    return false;
+}
+
+bool regd_send(const regd_request &request, string &reply)
+{
+    string path = get_socket_path();
+
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.empty() || path.size() >= sizeof(addr.sun_path)) {
+        return false;
+    }
+    strcpy(addr.sun_path, path.c_str());
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return false;
+    }
+
+    if (connect(fd, (sockaddr *)&addr, sizeof(addr)) < 0) {
+        debug("kb_regd is not listening on {}", path);
+        close(fd);
+        return false;
+    }
+
+    // Keys travel as their character code so that any character, even a space, can be a register
+    int key = request.key == "" ? 0 : (unsigned char)request.key.at(0);
+    string header = fmt::format("STORE {} {} {} {} {} {}\n",
+                                request.vendor_id, request.product_id, request.protocol, request.window,
+                                key, request.data.size());
+
+    bool ok = write_all(fd, header.data(), header.size()) &&
+              write_all(fd, request.data.data(), request.data.size()) &&
+              read_line(fd, reply);
+
+    if (!ok) {
+        reply = "ERR Lost connection to kb_regd";
+    }
+
+    close(fd);
+    return true;
+}
+
+bool regd_read_request(int fd, regd_request &request)
+{
+    string line;
+    if (!read_line(fd, line)) {
+        return false;
+    }
+
+    istringstream iss(line);
+    string command;
+    int key;
+    size_t length;
+    iss >> command >> request.vendor_id >> request.product_id >> request.protocol >> request.window >> key >> length;
+    if (!iss || command != "STORE" || key < 0 || key > 255 || length > REGD_MAX_DATA) {
+        error("Malformed request: {}", line);
+        return false;
+    }
+
+    request.key = key == 0 ? "" : string(1, (char)key);
+
+    request.data.resize(length);
+    return read_all(fd, request.data.data(), length);
+}
+
+void regd_write_reply(int fd, const string &reply)
+{
+    string line = reply + "\n";
+    write_all(fd, line.data(), line.size());
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <string>
+
+// Largest payload kb_regd accepts in one request
+#define REGD_MAX_DATA (1024 * 1024)
+
+// Unix socket kb_regd listens on: kb_regd.sock in get_runtime_dir(), empty
+// when there is no private runtime directory
+std::string get_socket_path();
+
+// One upload handed from kb_reg to kb_regd.
+//
+// On the wire a request is the line
+//   STORE <vendor> <product> <protocol> <window> <key> <length>\n
+// followed by length bytes of data.  key is the character code of the register,
+// or 0 to keep the current one.
+// kb_regd answers with a single line: "OK" or "ERR <message>".
+struct regd_request
+{
+    int vendor_id{0};
+    int product_id{0};
+    int protocol{0};
+    int window{0};
+    std::string key;
+    std::string data;
+};
+
+// Sends the request to a running kb_regd and waits for its reply.
+// Returns false without side effects when no daemon is listening.
+bool regd_send(const regd_request &request, std::string &reply);
+
+// Reads one request from a connected client.  Returns false on malformed input.
+bool regd_read_request(int fd, regd_request &request);
+
+// Answers the client with a single line
+void regd_write_reply(int fd, const std::string &reply);
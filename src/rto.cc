@@ -0,0 +1,29 @@
+#include "rto.h"
+
+#include <algorithm>
+
+using namespace std;
+using namespace std::chrono;
+
+void rto_estimator::sample(steady_clock::duration rtt)
+{
+    microseconds r = duration_cast<microseconds>(rtt);
+
+    if (!sampled) {
+        srtt = r;
+        rttvar = r / 2;
+        sampled = true;
+    } else {
+        // alpha = 1/8, beta = 1/4
+        microseconds delta = srtt > r ? srtt - r : r - srtt;
+        rttvar = (3 * rttvar + delta) / 4;
+        srtt = (7 * srtt + r) / 8;
+    }
+
+    rto = min(ceiling, srtt + std::max(granularity, 4 * rttvar));
+}
+
+void rto_estimator::backoff()
+{
+    rto = min(ceiling, 2 * rto);
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <chrono>
+
+// Retransmission timeout estimated from round trip samples the way TCP does
+// (RFC 6298): srtt and rttvar are moving averages of the round trip time and
+// its deviation, and the timeout is srtt + 4 rttvar.  Every timeout doubles
+// it until a round trip that needed no retransmission is sampled again.
+struct rto_estimator
+{
+    // Before the first sample.  Also how long v1 keyboards take to be
+    // recognised by not answering V.
+    static constexpr std::chrono::microseconds initial{10000};
+    // USB polls raw hid endpoints every millisecond, so a reply can't be
+    // expected any sooner than that after the average
+    static constexpr std::chrono::microseconds granularity{1000};
+    // Even a keyboard busy writing to EEPROM answers within this
+    static constexpr std::chrono::microseconds ceiling{500000};
+
+    std::chrono::microseconds srtt{0};
+    std::chrono::microseconds rttvar{0};
+    std::chrono::microseconds rto{initial};
+    bool sampled{false};
+
+    // Only pass round trips of reports that were written once (Karn's algorithm)
+    void sample(std::chrono::steady_clock::duration rtt);
+
+    // Doubles the timeout after a reply didn't arrive in time
+    void backoff();
+
+    std::chrono::microseconds timeout() const { return rto; }
+};
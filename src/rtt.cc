@@ -0,0 +1,127 @@
+#include "rtt.h"
+
+#include <bit>
+#include <algorithm>
+
+using namespace std;
+using namespace std::chrono;
+
+static int bucket_of(uint64_t us)
+{
+    if (us < rtt_histogram::sub_buckets) {
+        return us;
+    }
+
+    int msb = 63 - countl_zero(us);
+    int sub = (us >> (msb - 3)) & (rtt_histogram::sub_buckets - 1);
+    int index = (msb - 2) * rtt_histogram::sub_buckets + sub;
+
+    return min(index, rtt_histogram::bucket_count - 1);
+}
+
+// Largest value that falls into the bucket
+static uint64_t upper_bound_of(int index)
+{
+    if (index < rtt_histogram::sub_buckets) {
+        return index;
+    }
+
+    int msb = index / rtt_histogram::sub_buckets + 2;
+    int sub = index % rtt_histogram::sub_buckets;
+    uint64_t width = uint64_t(1) << (msb - 3);
+    return (uint64_t(rtt_histogram::sub_buckets + sub) << (msb - 3)) + width - 1;
+}
+
+void rtt_histogram::record(steady_clock::duration rtt)
+{
+    uint64_t us = duration_cast<microseconds>(rtt).count();
+
+    buckets[bucket_of(us)]++;
+    count++;
+    total_us += us;
+    min_us = min(min_us, us);
+    max_us = max(max_us, us);
+}
+
+void rtt_histogram::clear()
+{
+    *this = rtt_histogram();
+}
+
+void rtt_histogram::merge(const rtt_histogram &other)
+{
+    for (int i = 0; i < bucket_count; ++i) {
+        buckets[i] += other.buckets[i];
+    }
+    count += other.count;
+    total_us += other.total_us;
+    min_us = min(min_us, other.min_us);
+    max_us = max(max_us, other.max_us);
+}
+
+uint64_t rtt_histogram::count_at_most(uint64_t us) const
+{
+    uint64_t n = 0;
+    for (int i = 0; i < bucket_count && upper_bound_of(i) <= us; ++i) {
+        n += buckets[i];
+    }
+    return n;
+}
+
+uint64_t rtt_histogram::percentile(double q) const
+{
+    if (count == 0) {
+        return 0;
+    }
+
+    uint64_t rank = max<uint64_t>(1, q * count + 0.5);
+    uint64_t seen = 0;
+    for (int i = 0; i < bucket_count; ++i) {
+        seen += buckets[i];
+        if (seen >= rank) {
+            return min(upper_bound_of(i), max_us);
+        }
+    }
+    return max_us;
+}
+
+uint64_t rtt_histogram::mean() const
+{
+    return count ? total_us / count : 0;
+}
+
+void rtt_histogram::print(FILE *fp) const
+{
+    if (count == 0) {
+        fprintf(fp, "No round trips recorded\n");
+        return;
+    }
+
+    fprintf(fp, "%llu round trips  min %lluus  mean %lluus  p50 %lluus  p99 %lluus  max %lluus\n",
+            (unsigned long long)count, (unsigned long long)min_us, (unsigned long long)mean(),
+            (unsigned long long)percentile(0.5), (unsigned long long)percentile(0.99),
+            (unsigned long long)max_us);
+
+    uint64_t most = *max_element(buckets, buckets + bucket_count);
+    for (int i = 0; i < bucket_count; ++i) {
+        if (buckets[i] == 0) {
+            continue;
+        }
+        int width = (buckets[i] * 50 + most - 1) / most;
+        fprintf(fp, "%8lluus %8llu ", (unsigned long long)upper_bound_of(i), (unsigned long long)buckets[i]);
+        for (int j = 0; j < width; ++j) {
+            fputc('#', fp);
+        }
+        fputc('\n', fp);
+    }
+}
+
+void rtt_histogram::write_csv(ostream &os) const
+{
+    os << "upper_us,count\n";
+    for (int i = 0; i < bucket_count; ++i) {
+        if (buckets[i] != 0) {
+            os << upper_bound_of(i) << "," << buckets[i] << "\n";
+        }
+    }
+}
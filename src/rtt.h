@@ -0,0 +1,37 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <chrono>
+#include <ostream>
+
+// Histogram of report round trip times (write until the keyboard's reply is read).
+// Buckets are log-linear: 8 per power of two, so any percentile is within 12.5%.
+struct rtt_histogram
+{
+    static const int sub_buckets = 8;
+    static const int bucket_count = 8 + (25 - 3) * sub_buckets; // up to ~33 s
+
+    uint64_t buckets[bucket_count] = {};
+    uint64_t count = 0;
+    uint64_t total_us = 0;
+    uint64_t min_us = UINT64_MAX;
+    uint64_t max_us = 0;
+
+    void record(std::chrono::steady_clock::duration rtt);
+    void clear();
+    // Adds every sample of other
+    void merge(const rtt_histogram &other);
+
+    // Samples certainly no larger than us, for cumulative (Prometheus "le") buckets
+    uint64_t count_at_most(uint64_t us) const;
+
+    // Upper bound (in microseconds) of the bucket holding the given quantile (0.0 - 1.0)
+    uint64_t percentile(double q) const;
+    uint64_t mean() const;
+
+    // Human readable summary and bar chart
+    void print(FILE *fp) const;
+    // One "upper_us,count" line per non-empty bucket
+    void write_csv(std::ostream &os) const;
+};
@@ -0,0 +1,171 @@
+#include "trace.h"
+
+#include <atomic>
+#include <cctype>
+#include <cstdio>
+#include <mutex>
+#include <vector>
+
+#include <unistd.h>
+
+#include <spdlog/spdlog.h>
+
+using namespace std;
+using namespace std::chrono;
+using namespace spdlog;
+
+// Enough for a few thousand full 8 KB uploads; a daemon stops recording
+// rather than growing without bound
+static const size_t max_events{1 << 20};
+
+struct trace_event
+{
+    string name;
+    // 'X' for a span, 'b' and 'e' begin and end a report
+    char phase;
+    steady_clock::time_point time;
+    steady_clock::duration duration;
+    uint32_t tid;
+    uint64_t id;
+};
+
+static atomic<bool> enabled{false};
+static mutex events_mutex;
+static vector<trace_event> events;
+// Set once an event didn't fit, so the warning is only logged once
+static bool full{false};
+static string process_name;
+static steady_clock::time_point origin;
+static uint64_t next_report_id{0};
+
+// Small per-thread ids read better in the viewer than native thread ids
+static uint32_t thread_id()
+{
+    static atomic<uint32_t> next{1};
+    thread_local uint32_t tid = next++;
+    return tid;
+}
+
+// Must be called with events_mutex held
+static bool reserve(size_t n)
+{
+    if (full) {
+        return false;
+    }
+    if (events.size() + n > max_events) {
+        warn("Trace is full, no longer recording");
+        full = true;
+        return false;
+    }
+    return true;
+}
+
+void trace_enable(const string &process)
+{
+    lock_guard<mutex> lock(events_mutex);
+    process_name = process;
+    origin = steady_clock::now();
+    enabled = true;
+}
+
+bool trace_enabled()
+{
+    return enabled.load(memory_order_relaxed);
+}
+
+void trace_span(const string &name, steady_clock::time_point start, steady_clock::time_point end)
+{
+    if (!trace_enabled()) {
+        return;
+    }
+
+    lock_guard<mutex> lock(events_mutex);
+    if (reserve(1)) {
+        events.push_back(trace_event{name, 'X', start, end - start, thread_id(), 0});
+    }
+}
+
+void trace_report(unsigned char id, steady_clock::time_point sent, steady_clock::time_point acked)
+{
+    if (!trace_enabled()) {
+        return;
+    }
+
+    string name = isprint(id) ? string(1, id) : fmt::format("0x{:02x}", id);
+
+    lock_guard<mutex> lock(events_mutex);
+    if (reserve(2)) {
+        uint64_t report = next_report_id++;
+        events.push_back(trace_event{name, 'b', sent, {}, thread_id(), report});
+        events.push_back(trace_event{name, 'e', acked, {}, thread_id(), report});
+    }
+}
+
+// Microseconds since trace_enable, which is what viewers expect in ts and dur
+static double micros(steady_clock::duration d)
+{
+    return duration<double, micro>(d).count();
+}
+
+// Names are phase names and report ids, but may still hold a quote or backslash
+static string escape(const string &s)
+{
+    string out;
+    for (char c : s) {
+        if (c == '"' || c == '\\') {
+            out += '\\';
+        }
+        out += c;
+    }
+    return out;
+}
+
+bool trace_write(const string &path)
+{
+    // Held while writing so workers that finish together don't interleave
+    lock_guard<mutex> lock(events_mutex);
+
+    FILE *fp = fopen(path.c_str(), "w");
+    if (fp == nullptr) {
+        error("Unable to write trace to {}", path);
+        return false;
+    }
+
+    int pid = getpid();
+
+    fprintf(fp, "{\"traceEvents\":[\n");
+    fprintf(fp, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"%s\"}}",
+            pid, escape(process_name).c_str());
+    for (const trace_event &e : events) {
+        string name = escape(e.name);
+        double ts = micros(e.time - origin);
+        if (e.phase == 'X') {
+            fprintf(fp, ",\n{\"name\":\"%s\",\"cat\":\"phase\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%u}",
+                    name.c_str(), ts, micros(e.duration), pid, e.tid);
+        } else {
+            fprintf(fp, ",\n{\"name\":\"%s\",\"cat\":\"report\",\"ph\":\"%c\",\"id\":%llu,\"ts\":%.3f,\"pid\":%d,\"tid\":%u}",
+                    name.c_str(), e.phase, (unsigned long long) e.id, ts, pid, e.tid);
+        }
+    }
+    fprintf(fp, "\n],\"displayTimeUnit\":\"ms\"}\n");
+
+    if (fclose(fp) != 0) {
+        error("Unable to write trace to {}", path);
+        return false;
+    }
+    return true;
+}
+
+trace_scope::trace_scope(const char *name) : name(name)
+{
+    if (trace_enabled()) {
+        start = steady_clock::now();
+    }
+}
+
+trace_scope::~trace_scope()
+{
+    if (trace_enabled()) {
+        trace_span(name, start, steady_clock::now());
+    }
+}
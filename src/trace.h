@@ -0,0 +1,38 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+// Records timestamped spans in the Chrome trace event format, which
+// chrome://tracing and ui.perfetto.dev open directly.  Nothing is recorded
+// until trace_enable, so leaving the calls in costs one branch each.
+
+// Starts recording.  process names the process in the viewer.
+void trace_enable(const std::string &process);
+bool trace_enabled();
+
+// A phase on the calling thread, drawn as a nested slice
+void trace_span(const std::string &name, std::chrono::steady_clock::time_point start,
+                std::chrono::steady_clock::time_point end);
+
+// One report from write until its reply.  Reports in flight overlap, so each
+// is drawn on its own async track rather than nested in the phases.
+void trace_report(unsigned char id, std::chrono::steady_clock::time_point sent,
+                  std::chrono::steady_clock::time_point acked);
+
+// Writes everything recorded so far to path as {"traceEvents": [...]}.
+// Recording continues, so a daemon can rewrite the file after every job.
+bool trace_write(const std::string &path);
+
+// Records a trace_span from construction to destruction
+class trace_scope
+{
+public:
+    explicit trace_scope(const char *name);
+    ~trace_scope();
+
+private:
+    const char *name;
+    std::chrono::steady_clock::time_point start;
+};
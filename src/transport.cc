@@ -0,0 +1,195 @@
+#include "transport.h"
+#include "hidutil.h"
+#include "trace.h"
+#include "path_cache.h"
+
+#include <map>
+#include <mutex>
+
+using namespace std;
+
+// hid_get_report_descriptor appeared in hidapi 0.14
+#if defined(HID_API_MAKE_VERSION) && HID_API_VERSION >= HID_API_MAKE_VERSION(0, 14, 0)
+#define HAVE_HID_GET_REPORT_DESCRIPTOR 1
+#endif
+
+// device_strings of every raw interface seen, indexed by path.  Workers open
+// keyboards concurrently, so every access holds cache_mutex.
+static map<string, device_strings> cache;
+static mutex cache_mutex;
+
+static wstring wstring_or_empty(const wchar_t *str)
+{
+    return str ? wstring(str) : wstring();
+}
+
+void remember_device_strings(const string &path, const hid_device_info *info)
+{
+    device_strings strings;
+    strings.serial = wstring_or_empty(info->serial_number);
+    if (info->manufacturer_string) {
+        strings.vendor = info->manufacturer_string;
+    }
+    if (info->product_string) {
+        strings.product = info->product_string;
+    }
+
+    lock_guard<mutex> lock(cache_mutex);
+    auto i = cache.find(path);
+    // Keep strings resolved since the last enumeration if it's the same keyboard
+    if (i != cache.end() && i->second.serial == strings.serial) {
+        if (!strings.vendor) {
+            strings.vendor = i->second.vendor;
+        }
+        if (!strings.product) {
+            strings.product = i->second.product;
+        }
+    }
+    cache[path] = strings;
+}
+
+void forget_device_strings(const string &path)
+{
+    lock_guard<mutex> lock(cache_mutex);
+    cache.erase(path);
+}
+
+// Returns the cached string selected by field, asking the device with get
+// and caching the answer when nothing is cached yet
+static wstring cached_string(hid_device *dev, const string &path,
+                             optional<wstring> device_strings::*field, wstring (*get)(hid_device *))
+{
+    if (path.empty()) {
+        trace_scope span("descriptors");
+        return get(dev);
+    }
+
+    {
+        lock_guard<mutex> lock(cache_mutex);
+        auto i = cache.find(path);
+        if (i != cache.end() && i->second.*field) {
+            return *(i->second.*field);
+        }
+    }
+
+    wstring str;
+    {
+        trace_scope span("descriptors");
+        str = get(dev);
+    }
+
+    lock_guard<mutex> lock(cache_mutex);
+    cache[path].*field = str;
+    return str;
+}
+
+hid_transport::hid_transport(hid_device *dev, const string &path) : dev(dev), path(path)
+{
+}
+
+hid_transport::~hid_transport()
+{
+    trace_scope span("close");
+    hid_close(dev);
+}
+
+int hid_transport::write(const unsigned char *data, size_t length)
+{
+    return hid_write(dev, data, length);
+}
+
+int hid_transport::read_timeout(unsigned char *data, size_t length, int milliseconds)
+{
+    return hid_read_timeout(dev, data, length, milliseconds);
+}
+
+wstring hid_transport::vendor()
+{
+    return cached_string(dev, path, &device_strings::vendor, get_vendor);
+}
+
+wstring hid_transport::product()
+{
+    return cached_string(dev, path, &device_strings::product, get_product);
+}
+
+// Bytes of output report a report descriptor declares.  The raw interface has
+// a single output report, so every Output item counts towards it.
+static size_t output_report_bytes(const unsigned char *desc, size_t size)
+{
+    uint32_t report_size{0};
+    uint32_t report_count{0};
+    size_t bits{0};
+
+    for (size_t i = 0; i < size; ) {
+        unsigned char prefix = desc[i];
+        if (prefix == 0xfe) {
+            // Long item: prefix, data size, tag, data
+            if (i + 1 >= size) {
+                break;
+            }
+            i += 3 + desc[i + 1];
+            continue;
+        }
+
+        size_t n = prefix & 0x03;
+        if (n == 3) {
+            n = 4;
+        }
+        if (i + 1 + n > size) {
+            break;
+        }
+        uint32_t value{0};
+        for (size_t b = 0; b < n; ++b) {
+            value |= uint32_t(desc[i + 1 + b]) << (8 * b);
+        }
+
+        switch (prefix & 0xfc) {
+        case 0x74: // Report Size
+            report_size = value;
+            break;
+        case 0x94: // Report Count
+            report_count = value;
+            break;
+        case 0x90: // Output
+            bits += size_t(report_size) * report_count;
+            break;
+        }
+        i += 1 + n;
+    }
+
+    return bits / 8;
+}
+
+size_t hid_transport::descriptor_message_size()
+{
+#ifdef HAVE_HID_GET_REPORT_DESCRIPTOR
+    trace_scope span("descriptors");
+    unsigned char desc[HID_API_MAX_REPORT_DESCRIPTOR_SIZE];
+    int res = hid_get_report_descriptor(dev, desc, sizeof(desc));
+    if (res <= 0) {
+        return 0;
+    }
+    return output_report_bytes(desc, res);
+#else
+    return 0;
+#endif
+}
+
+int hid_transport::remembered_protocol()
+{
+    return path.empty() ? 0 : cached_protocol(path);
+}
+
+void hid_transport::remember_protocol(int protocol)
+{
+    if (!path.empty()) {
+        cache_protocol(path, protocol);
+    }
+}
+
+wstring hid_transport::error()
+{
+    const wchar_t *msg = hid_error(dev);
+    return msg ? wstring(msg) : wstring(L"Unknown error");
+}
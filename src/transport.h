@@ -0,0 +1,126 @@
+#pragma once
+
+#include <string>
+#include <optional>
+#include <hidapi.h>
+
+#include "rtt.h"
+#include "rto.h"
+
+// What a keyboard with KB_CAP_LIMITS says about itself in its V reply.
+// Zero means it didn't say.
+struct keyboard_limits
+{
+    // Bytes of text one register holds (KB_REGISTER_BUFFER_MAX in the firmware)
+    size_t max_register{0};
+    // Bytes malloc could still hand out when the keyboard answered
+    size_t free_memory{0};
+    // RAW_EPSIZE
+    size_t report_size{0};
+};
+
+// The raw hid interface of a keyboard.  hid_transport talks to hardware
+// through hidapi, kb_sim (kb_sim.h) emulates the firmware in process.
+class transport
+{
+public:
+    virtual ~transport() = default;
+
+    // Writes one report.  data[0] is the report id.  Returns bytes written or -1.
+    virtual int write(const unsigned char *data, size_t length) = 0;
+
+    // Waits up to milliseconds for one report.  Returns bytes read, 0 on timeout or -1.
+    virtual int read_timeout(unsigned char *data, size_t length, int milliseconds) = 0;
+
+    virtual std::wstring vendor() = 0;
+    virtual std::wstring product() = 0;
+
+    // Description of the last error
+    virtual std::wstring error() = 0;
+
+    // Bytes of the output report the report descriptor declares (without the
+    // report id), or 0 when it can't be read
+    virtual size_t descriptor_message_size() { return 0; }
+
+    // Protocol the keyboard answered V with the last time it was asked, 0
+    // when unknown, and remembering it for next time
+    virtual int remembered_protocol() { return 0; }
+    virtual void remember_protocol(int) {}
+
+    // Bytes of every report written, including the report id
+    size_t report_size() const { return message_size + 1; }
+
+    // Round trip times of every report acknowledged so far
+    rtt_histogram rtt;
+    // Reports written so far, and their bytes including the report id
+    uint64_t reports{0};
+    uint64_t bytes{0};
+    // Replies that never came, and "Overflow" and "Out of Memory" replies
+    // (or batch statuses) so far
+    uint64_t timeouts{0};
+    uint64_t overflows{0};
+    uint64_t out_of_memory{0};
+    // Reports written again because their reply timed out
+    uint64_t retransmits{0};
+    // Uploads abandoned because the device failed or stopped answering, as
+    // opposed to the keyboard answering with an error
+    uint64_t failures{0};
+    // How long to wait for a reply before writing the report again
+    rto_estimator rto;
+    // Sequence number of the next frame_window's first frame.  Numbering
+    // carries on from upload to upload, so acks the keyboard repeats for an
+    // earlier upload never match frames of the current one.
+    uint8_t next_seq{0};
+    // Time to store each register, from its first report until the keyboard
+    // acknowledged its last.  Registers of a batch all take the whole batch.
+    rtt_histogram registers;
+    // KB_CAP_* bits from the keyboard's V reply, set by query_protocol
+    unsigned capabilities{0};
+    // Limits from the V reply, set by query_protocol.  free_memory is only
+    // current right after it.
+    keyboard_limits limits;
+    // Bytes of each message after the report id, KB_MESSAGE_SIZE unless
+    // query_protocol found the keyboard takes KB_LARGE_MESSAGE_SIZE
+    size_t message_size{32};
+};
+
+// Manufacturer and product strings of an attached keyboard.  hid_enumerate
+// already reports them, so remembering them there saves the two control
+// transfers hid_get_*_string would cost on every open.
+struct device_strings
+{
+    std::wstring serial;
+    std::optional<std::wstring> vendor;
+    std::optional<std::wstring> product;
+};
+
+// Remembers the strings enumeration reported for path.  Replaces whatever was
+// cached for path, so a different keyboard attached at the same path (or the
+// same one re-attached) never sees stale strings.
+void remember_device_strings(const std::string &path, const hid_device_info *info);
+
+// Drops everything cached for path
+void forget_device_strings(const std::string &path);
+
+class hid_transport : public transport
+{
+public:
+    // Takes ownership of dev and closes it when destroyed.  path keys the
+    // device_strings cache; without it vendor() and product() ask the device.
+    explicit hid_transport(hid_device *dev, const std::string &path = "");
+    ~hid_transport() override;
+
+    int write(const unsigned char *data, size_t length) override;
+    int read_timeout(unsigned char *data, size_t length, int milliseconds) override;
+
+    std::wstring vendor() override;
+    std::wstring product() override;
+    std::wstring error() override;
+    size_t descriptor_message_size() override;
+    int remembered_protocol() override;
+    void remember_protocol(int protocol) override;
+
+private:
+    hid_device *dev;
+    std::string path;
+};
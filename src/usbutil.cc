@@ -21,6 +21,26 @@ union string_desc_buf {
         uint16_t align;         /* Force 2-byte alignment */
 };
 
+// Reads the first language ID from string descriptor 0
+static int get_langid(libusb_device_handle *handle, uint16_t &langid)
+{
+    string_desc_buf str;
+    int r = libusb_get_string_descriptor(handle, 0, 0, str.buf, 4);
+    if (r < 0)
+        return r;
+    else if (r != 4 || str.desc.bLength < 4)
+        return LIBUSB_ERROR_IO;
+    else if (str.desc.bDescriptorType != LIBUSB_DT_STRING)
+        return LIBUSB_ERROR_IO;
+    else if (str.desc.bLength & 1)
+        warn("suspicious bLength {} for language ID string descriptor", str.desc.bLength);
+
+    // en-US: 0x0409
+    //uint16_t langid = 0x0409;
+    langid = libusb_le16_to_cpu(str.desc.wData[0]);
+    return 0;
+}
+
 pair<int, string> get_utf8_string(libusb_device_handle *handle, uint8_t id)
 {
     /* Asking for the zero'th index is special - it returns a string
@@ -33,33 +53,24 @@ pair<int, string> get_utf8_string(libusb_device_handle *handle, uint8_t id)
      */
 
     if (id == 0)
-        return pair(LIBUSB_ERROR_INVALID_PARAM, nullptr);
+        return pair(LIBUSB_ERROR_INVALID_PARAM, string());
 
-    string_desc_buf str;
-    int r = libusb_get_string_descriptor(handle, 0, 0, str.buf, 4);
+    uint16_t langid;
+    int r = get_langid(handle, langid);
     if (r < 0)
-        return pair(r, nullptr);
-    else if (r != 4 || str.desc.bLength < 4)
-        return pair(LIBUSB_ERROR_IO, nullptr);
-    else if (str.desc.bDescriptorType != LIBUSB_DT_STRING)
-        return pair(LIBUSB_ERROR_IO, nullptr);
-    else if (str.desc.bLength & 1)
-        warn("suspicious bLength %u for language ID string descriptor", str.desc.bLength);
-
-    // en-US: 0x0409
-    //uint16_t langid = 0x0409;
-    uint16_t langid = libusb_le16_to_cpu(str.desc.wData[0]);
-    debug("String ID {} returned langid 0x{:04x}", id, langid);
+        return pair(r, string());
+    debug("String ID {} using langid 0x{:04x}", id, langid);
 
+    string_desc_buf str;
     r = libusb_get_string_descriptor(handle, id, langid, str.buf, sizeof(str.buf));
     if (r < 0)
-        return pair(r, nullptr);
+        return pair(r, string());
     else if (r < DESC_HEADER_LENGTH || str.desc.bLength > r)
-        return pair(LIBUSB_ERROR_IO, nullptr);
+        return pair(LIBUSB_ERROR_IO, string());
     else if (str.desc.bDescriptorType != LIBUSB_DT_STRING)
-        return pair(LIBUSB_ERROR_IO, nullptr);
+        return pair(LIBUSB_ERROR_IO, string());
     else if ((str.desc.bLength & 1) || str.desc.bLength != r)
-        warn("suspicious bLength %u for string descriptor (read %d)", str.desc.bLength, r);
+        warn("suspicious bLength {} for string descriptor (read {})", str.desc.bLength, r);
 
     /* The descriptor has this number of wide characters */
     int src_max = (str.desc.bLength - 1 - 1) / 2;
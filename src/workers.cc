@@ -0,0 +1,64 @@
+#include "workers.h"
+
+using namespace std;
+
+worker_pool::worker_pool(size_t threads)
+{
+    for (size_t i = 0; i < threads; ++i) {
+        this->threads.emplace_back(&worker_pool::run, this);
+    }
+}
+
+worker_pool::~worker_pool()
+{
+    {
+        lock_guard<std::mutex> lock(mutex);
+        stop = true;
+    }
+    work_ready.notify_all();
+
+    for (thread &t : threads) {
+        t.join();
+    }
+}
+
+void worker_pool::submit(function<void()> job)
+{
+    {
+        lock_guard<std::mutex> lock(mutex);
+        jobs.push_back(move(job));
+    }
+    work_ready.notify_one();
+}
+
+void worker_pool::wait()
+{
+    unique_lock<std::mutex> lock(mutex);
+    work_done.wait(lock, [this] { return jobs.empty() && running == 0; });
+}
+
+void worker_pool::run()
+{
+    unique_lock<std::mutex> lock(mutex);
+
+    while (true) {
+        work_ready.wait(lock, [this] { return stop || !jobs.empty(); });
+        if (jobs.empty()) {
+            // Only stopping once the queue is empty
+            return;
+        }
+
+        function<void()> job = move(jobs.front());
+        jobs.pop_front();
+        ++running;
+
+        lock.unlock();
+        job();
+        lock.lock();
+
+        --running;
+        if (jobs.empty() && running == 0) {
+            work_done.notify_all();
+        }
+    }
+}
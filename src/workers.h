@@ -0,0 +1,34 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A fixed set of threads running queued jobs, so several keyboards can be
+// configured at once
+class worker_pool
+{
+public:
+    explicit worker_pool(size_t threads);
+    // Finishes the queued jobs before returning
+    ~worker_pool();
+
+    void submit(std::function<void()> job);
+
+    // Blocks until every job submitted so far has finished
+    void wait();
+
+private:
+    void run();
+
+    std::mutex mutex;
+    std::condition_variable work_ready;
+    std::condition_variable work_done;
+    std::deque<std::function<void()>> jobs;
+    size_t running{0};
+    bool stop{false};
+    std::vector<std::thread> threads;
+};